@@ -6,30 +6,65 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cache.h"
+#include "port.h"
 #include "psram.h"
+#include "trace.h"
+#include "zram.h"
 
 #define CACHESIZE	4096
 struct cacheline {
 	uint8_t data[64];
 };
 
-static uint64_t accessed, hit;
-static uint32_t tags[CACHESIZE/64/2][2];
-static struct cacheline cachelines[CACHESIZE/64/2][2];
+static __vm uint64_t accessed, hit, writebacks, splits;
+/* bytes that went to and from PSRAM, at the transfers themselves */
+static __vm uint64_t psram_rd, psram_wr;
+/* lines written back by cache_clean(), and evictions that found them still clean */
+static __vm uint64_t cleaned, clean_evictions;
+static __vm uint32_t tags[CACHESIZE/64/2][2];
+static __vm struct cacheline cachelines[CACHESIZE/64/2][2];
+/* directly mapped RAM, used instead of the lines when set */
+static __vm uint8_t *bypass;
+static __vm uint8_t wbbuf[64];
+static __vm struct psram_req wbreq;
+/* for cache_move() and cache_set() */
+static __vm uint8_t bulkbuf[1024];
+/*
+ * One bit per line of RAM that is known to read as zero, whatever PSRAM
+ * holds there: the lines the kernel image doesn't cover, and the ones the
+ * guest cleared with cache_set(). A bit is dropped when its line is
+ * written back.
+ */
+static __vm uint32_t *zeromap;
+static __vm uint32_t zeromap_lines;
+static __vm uint64_t zero_reads, zero_marked;
+/*
+ * The kernel image where the port can map it read only, flash on the
+ * MCUs. Its lines are read from there until their page is first written
+ * back, which copies the page to RAM: one bit per page in rom_copied.
+ */
+#define ROM_PAGE_SHIFT	12
+static __vm const uint8_t *rom;
+static __vm uint32_t rom_len;
+static __vm uint32_t *rom_copied;
+static __vm uint64_t rom_reads, rom_copies;
 
 /*
  * bit[0]: valid
  * bit[1]: dirty
  * bit[2]: for LRU
- * bit[3:10]: reserved
+ * bit[3]: written back by cache_clean(), until the line is replaced
+ * bit[4:10]: reserved
  * bit[11:31]: tag
  */
 #define VALID		(1 << 0)
 #define DIRTY		(1 << 1)
 #define LRU		(1 << 2)
+#define CLEANED		(1 << 3)
 #define LRU_SFT		2
 #define TAG_MSK		0xfffff800
 
@@ -43,10 +78,196 @@ static inline int get_index(uint32_t addr)
 	return (addr >> 6) & 0x1f;
 }
 
+static inline int zero_test(uint32_t ofs)
+{
+	uint32_t line = ofs >> 6;
+
+	return line < zeromap_lines && (zeromap[line / 32] & (1u << (line % 32)));
+}
+
+static inline void zero_clear(uint32_t ofs)
+{
+	uint32_t line = ofs >> 6;
+
+	if (line < zeromap_lines)
+		zeromap[line / 32] &= ~(1u << (line % 32));
+}
+
+static inline int rom_test(uint32_t ofs)
+{
+	uint32_t page = ofs >> ROM_PAGE_SHIFT;
+
+	return ofs < rom_len && !(rom_copied[page / 32] & (1u << (page % 32)));
+}
+
+/* RAM lives in PSRAM, or compressed in host memory with zram */
+static inline void mem_read(uint32_t ofs, void *buf, uint32_t len)
+{
+	if (zram_budget) {
+		zram_read(ofs, buf, len);
+		return;
+	}
+	psram_rd += len;
+	psram_read(ofs, buf, len);
+}
+
+static inline void mem_write(uint32_t ofs, void *buf, uint32_t len)
+{
+	if (zram_budget) {
+		zram_write(ofs, buf, len);
+		return;
+	}
+	psram_wr += len;
+	psram_write(ofs, buf, len);
+}
+
+/* Copy the pages of the image that [ofs, ofs + len) touches to RAM */
+static void rom_copy(uint32_t ofs, uint32_t len)
+{
+	uint32_t page, n;
+
+	for (page = ofs >> ROM_PAGE_SHIFT; page <= (ofs + len - 1) >> ROM_PAGE_SHIFT; page++) {
+		if (!rom_test(page << ROM_PAGE_SHIFT))
+			continue;
+		n = rom_len - (page << ROM_PAGE_SHIFT);
+		if (n > 1 << ROM_PAGE_SHIFT)
+			n = 1 << ROM_PAGE_SHIFT;
+		mem_write(page << ROM_PAGE_SHIFT, (void *)(rom + (page << ROM_PAGE_SHIFT)), n);
+		rom_copied[page / 32] |= 1u << (page % 32);
+		rom_copies++;
+	}
+}
+
+/* psram_read() with the zero lines and the image filled in here */
+static void ram_read(uint32_t ofs, uint8_t *buf, uint32_t len)
+{
+	uint32_t n, run;
+
+	for (; len; ofs += n, buf += n, len -= n) {
+		n = 64 - (ofs & 0x3f);
+		if (n > len)
+			n = len;
+		if (zero_test(ofs)) {
+			zero_reads++;
+			memset(buf, 0, n);
+			continue;
+		}
+		if (rom_test(ofs)) {
+			rom_reads++;
+			memcpy(buf, rom + ofs, n);
+			continue;
+		}
+		// the lines up to the next zero or image one in a single transfer
+		for (run = n; run < len && !zero_test(ofs + run) && !rom_test(ofs + run); run += 64)
+			;
+		n = run < len ? run : len;
+		mem_read(ofs, buf, n);
+	}
+}
+
+/*
+ * psram_write() that drops the zero bits of the lines it writes. Only the
+ * first and the last line can be partial, those are written whole then,
+ * since the rest of them has to read as zero as well.
+ */
+static void ram_write(uint32_t ofs, uint8_t *buf, uint32_t len)
+{
+	uint8_t line[64];
+	uint32_t n, i;
+
+	if (rom_len)
+		rom_copy(ofs, len);
+	for (; len; ofs += n, buf += n, len -= n) {
+		n = 64 - (ofs & 0x3f);
+		if (n > len)
+			n = len;
+		if (n < 64 && zero_test(ofs)) {
+			memset(line, 0, sizeof(line));
+			memcpy(line + (ofs & 0x3f), buf, n);
+			zero_clear(ofs);
+			mem_write(ofs & ~0x3f, line, 64);
+			continue;
+		}
+		// whole lines, up to the partial last one
+		for (i = n; i + 64 <= len; i += 64)
+			zero_clear(ofs + i);
+		zero_clear(ofs);
+		// a partial last line that is zero goes on its own
+		n = i < len && zero_test(ofs + i) ? i : len;
+		mem_write(ofs, buf, n);
+	}
+}
+
+/*
+ * Load the line at ofs into p, writing back what p held if it is dirty.
+ * The writeback is copied aside and submitted after the read, so it runs
+ * while the guest goes on. The read of the next miss waits for it.
+ */
+static void cache_refill(uint32_t tag, uint8_t *p, uint32_t ofs)
+{
+	if (!(tag & DIRTY)) {
+		if (tag & CLEANED)
+			clean_evictions++;
+		ram_read(ofs & ~0x3f, p, 64);
+		return;
+	}
+
+	writebacks++;
+	trace(TRACE_WRITEBACK, 0, tag & ~0x3f);
+	// zram is host memory, there is nothing to overlap
+	if (zram_budget) {
+		ram_write(tag & ~0x3f, p, 64);
+		ram_read(ofs & ~0x3f, p, 64);
+		return;
+	}
+	psram_wait(&wbreq);
+	memcpy(wbbuf, p, 64);
+	wbreq.addr = tag & ~0x3f;
+	wbreq.buf = wbbuf;
+	wbreq.len = 64;
+	wbreq.write = 1;
+	zero_clear(wbreq.addr);
+	if (rom_len)
+		rom_copy(wbreq.addr, 64);
+	ram_read(ofs & ~0x3f, p, 64);
+	psram_wr += wbreq.len;
+	psram_submit(&wbreq);
+}
+
+/*
+ * A misaligned access may cross into the next line, which is in the next
+ * set, so bringing either line in can't evict the other. Each part is
+ * done on its own line and counted as an access of its own.
+ */
+static void cache_write_split(uint32_t ofs, uint8_t *buf, uint32_t size)
+{
+	uint32_t n = 64 - (ofs & 0x3f);
+
+	splits++;
+	cache_write(ofs, buf, n);
+	cache_write(ofs + n, buf + n, size - n);
+}
+
+static void cache_read_split(uint32_t ofs, uint8_t *buf, uint32_t size)
+{
+	uint32_t n = 64 - (ofs & 0x3f);
+
+	splits++;
+	cache_read(ofs, buf, n);
+	cache_read(ofs + n, buf + n, size - n);
+}
+
 void cache_write(uint32_t ofs, void *buf, uint32_t size)
 {
-	if (((ofs | (64 - 1)) != ((ofs + size - 1) | (64 - 1))))
-		printf("write cross boundary, ofs:%x size:%x\n", ofs, size);
+	if (bypass) {
+		memcpy(bypass + ofs, buf, size);
+		return;
+	}
+
+	if (__builtin_expect((ofs & 0x3f) + size > 64, 0)) {
+		cache_write_split(ofs, buf, size);
+		return;
+	}
 
 	int ti, i, index = get_index(ofs);
 	uint32_t *tp;
@@ -70,10 +291,8 @@ void cache_write(uint32_t ofs, void *buf, uint32_t size)
 				tp = &tags[index][ti];
 				p = cachelines[index][ti].data;
 
-				if (*tp & DIRTY) {
-					psram_write(*tp & ~0x3f, p, 64);
-				}
-				psram_read(ofs & ~0x3f, p, 64);
+				trace(TRACE_CACHE_MISS, 1, ofs);
+				cache_refill(*tp, p, ofs);
 				*tp = ofs & ~0x3f;
 				*tp |= VALID;
 			}
@@ -82,7 +301,8 @@ void cache_write(uint32_t ofs, void *buf, uint32_t size)
 				continue;
 
 			ti = i;
-			psram_read(ofs & ~0x3f, p, 64);
+			trace(TRACE_CACHE_MISS, 1, ofs);
+			ram_read(ofs & ~0x3f, p, 64);
 			*tp = ofs & ~0x3f;
 			*tp |= VALID;
 		}
@@ -96,8 +316,15 @@ void cache_write(uint32_t ofs, void *buf, uint32_t size)
 
 void cache_read(uint32_t ofs, void *buf, uint32_t size)
 {
-	if (((ofs | (64 - 1)) != ((ofs + size - 1) | (64 - 1))))
-		printf("read cross boundary, ofs:%x size:%x\n", ofs, size);
+	if (bypass) {
+		memcpy(buf, bypass + ofs, size);
+		return;
+	}
+
+	if (__builtin_expect((ofs & 0x3f) + size > 64, 0)) {
+		cache_read_split(ofs, buf, size);
+		return;
+	}
 
 	int ti, i, index = get_index(ofs);
 	uint32_t *tp;
@@ -121,10 +348,8 @@ void cache_read(uint32_t ofs, void *buf, uint32_t size)
 				tp = &tags[index][ti];
 				p = cachelines[index][ti].data;
 
-				if (*tp & DIRTY) {
-					psram_write(*tp & ~0x3f, p, 64);
-				}
-				psram_read(ofs & ~0x3f, p, 64);
+				trace(TRACE_CACHE_MISS, 0, ofs);
+				cache_refill(*tp, p, ofs);
 				*tp = ofs & ~0x3f;
 				*tp |= VALID;
 			}
@@ -133,7 +358,8 @@ void cache_read(uint32_t ofs, void *buf, uint32_t size)
 				continue;
 
 			ti = i;
-			psram_read(ofs & ~0x3f, p, 64);
+			trace(TRACE_CACHE_MISS, 0, ofs);
+			ram_read(ofs & ~0x3f, p, 64);
 			*tp = ofs & ~0x3f;
 			*tp |= VALID;
 		}
@@ -144,8 +370,312 @@ void cache_read(uint32_t ofs, void *buf, uint32_t size)
 	memcpy(buf, p + (ofs & 0x3f), size);
 }
 
+/*
+ * Bulk accessors for device DMA, ofs and size may be anything, the access
+ * is split at cacheline boundaries.
+ */
+void cache_read_buf(uint32_t ofs, void *buf, uint32_t size)
+{
+	uint8_t *p = buf;
+	uint32_t n;
+
+	while (size) {
+		n = 64 - (ofs & 0x3f);
+		if (n > size)
+			n = size;
+		cache_read(ofs, p, n);
+		ofs += n;
+		p += n;
+		size -= n;
+	}
+}
+
+void cache_write_buf(uint32_t ofs, void *buf, uint32_t size)
+{
+	uint8_t *p = buf;
+	uint32_t n;
+
+	while (size) {
+		n = 64 - (ofs & 0x3f);
+		if (n > size)
+			n = size;
+		cache_write(ofs, p, n);
+		ofs += n;
+		p += n;
+		size -= n;
+	}
+}
+
+/* Data of the line holding ofs if it is cached, NULL if not; not counted as an access */
+static uint8_t *cache_find(uint32_t ofs, uint32_t **tp)
+{
+	int i, index = get_index(ofs);
+
+	for (i = 0; i < 2; i++) {
+		if ((tags[index][i] & VALID) && (tags[index][i] & TAG_MSK) == (ofs & TAG_MSK)) {
+			*tp = &tags[index][i];
+			return cachelines[index][i].data;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Length of the run at ofs, at most len bytes, that is either all in the
+ * cache or all out of it. *p is the cached data or NULL.
+ */
+static uint32_t cache_span(uint32_t ofs, uint32_t len, uint8_t **p, uint32_t **tp)
+{
+	uint32_t n = 64 - (ofs & 0x3f);
+	uint32_t *t;
+
+	*p = cache_find(ofs, tp);
+	if (*p)
+		return n < len ? n : len;
+	while (n < len && !cache_find(ofs + n, &t))
+		n += 64;
+	return n < len ? n : len;
+}
+
+static void cache_bulk_read(uint32_t ofs, uint8_t *buf, uint32_t len)
+{
+	uint32_t n, *tp;
+	uint8_t *p;
+
+	for (; len; ofs += n, buf += n, len -= n) {
+		n = cache_span(ofs, len, &p, &tp);
+		if (p)
+			memcpy(buf, p + (ofs & 0x3f), n);
+		else
+			ram_read(ofs, buf, n);
+	}
+}
+
+static void cache_bulk_write(uint32_t ofs, uint8_t *buf, uint32_t len)
+{
+	uint32_t n, *tp;
+	uint8_t *p;
+
+	for (; len; ofs += n, buf += n, len -= n) {
+		n = cache_span(ofs, len, &p, &tp);
+		if (p) {
+			memcpy(p + (ofs & 0x3f), buf, n);
+			*tp |= DIRTY;
+		} else {
+			ram_write(ofs, buf, n);
+		}
+	}
+}
+
+/*
+ * memmove() and memset() of guest RAM for the host. Lines that are cached
+ * are updated in place, the rest moves between PSRAM and a bounce buffer
+ * in runs as long as the buffer without going through the cache, so they
+ * neither evict anything nor count as accesses.
+ */
+void cache_move(uint32_t dst, uint32_t src, uint32_t len)
+{
+	uint32_t n;
+
+	if (bypass) {
+		memmove(bypass + dst, bypass + src, len);
+		return;
+	}
+
+	// copy backwards if dst overlaps the end of src
+	if (dst > src && dst - src < len) {
+		while (len) {
+			n = len < sizeof(bulkbuf) ? len : sizeof(bulkbuf);
+			len -= n;
+			cache_bulk_read(src + len, bulkbuf, n);
+			cache_bulk_write(dst + len, bulkbuf, n);
+		}
+		return;
+	}
+
+	for (; len; dst += n, src += n, len -= n) {
+		n = len < sizeof(bulkbuf) ? len : sizeof(bulkbuf);
+		cache_bulk_read(src, bulkbuf, n);
+		cache_bulk_write(dst, bulkbuf, n);
+	}
+}
+
+static void cache_fill(uint32_t dst, uint8_t c, uint32_t len)
+{
+	uint32_t n;
+
+	memset(bulkbuf, c, len < sizeof(bulkbuf) ? len : sizeof(bulkbuf));
+	for (; len; dst += n, len -= n) {
+		n = len < sizeof(bulkbuf) ? len : sizeof(bulkbuf);
+		cache_bulk_write(dst, bulkbuf, n);
+	}
+}
+
+/* Mark len bytes of whole lines at dst zero, their cached copies are stale then */
+static void cache_zero_lines(uint32_t dst, uint32_t len)
+{
+	uint32_t line, *tp;
+
+	for (; len; dst += 64, len -= 64) {
+		line = dst >> 6;
+		if (cache_find(dst, &tp))
+			*tp &= LRU;
+		zeromap[line / 32] |= 1u << (line % 32);
+		zero_marked++;
+	}
+}
+
+/*
+ * Clearing whole lines costs no PSRAM transfer at all, they are only
+ * marked zero. That is how the guest hands back pages it freed: with
+ * init_on_free, or any memset() to 0 going through CSR_HCALL_SET.
+ */
+void cache_set(uint32_t dst, uint8_t c, uint32_t len)
+{
+	uint32_t n;
+
+	if (bypass) {
+		memset(bypass + dst, c, len);
+		return;
+	}
+
+	n = -dst & 0x3f;
+	if (c || !zeromap || len < n + 64) {
+		cache_fill(dst, c, len);
+		return;
+	}
+
+	cache_fill(dst, 0, n);
+	dst += n;
+	len -= n;
+	n = len & ~0x3f;
+	cache_zero_lines(dst, n);
+	cache_fill(dst + n, 0, len - n);
+}
+
+/*
+ * Write dirty lines back while the guest idles, so that evicting them
+ * later doesn't have to. The least recently used way of each set goes
+ * first, it is the next to be evicted. Stops once budget_us is used up.
+ */
+void cache_clean(uint32_t budget_us)
+{
+	uint64_t start = GetTimeMicroseconds();
+	int pass, index, way;
+	uint32_t *tp;
+
+	if (bypass)
+		return;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (index = 0; index < CACHESIZE/64/2; index++) {
+			way = 1 - ((tags[index][1] & LRU) >> LRU_SFT);
+			if (pass)
+				way = 1 - way;
+			tp = &tags[index][way];
+			if (!(*tp & DIRTY))
+				continue;
+			if (GetTimeMicroseconds() - start >= budget_us)
+				return;
+			ram_write(*tp & ~0x3f, cachelines[index][way].data, 64);
+			*tp = (*tp & ~DIRTY) | CLEANED;
+			cleaned++;
+		}
+	}
+}
+
+/*
+ * Start over with RAM freshly loaded: only the first image_len bytes hold
+ * anything, the rest reads as zero. What the cache held from before the
+ * (re)boot is dropped.
+ */
+void cache_zero_init(uint32_t ram_size, uint32_t image_len)
+{
+	uint32_t line;
+
+	memset(tags, 0, sizeof(tags));
+	if (!zeromap) {
+		zeromap = calloc((ram_size / 64 + 31) / 32, sizeof(*zeromap));
+		if (!zeromap) {
+			printf("no memory for the zero map, not tracking zero lines\n");
+			return;
+		}
+		zeromap_lines = ram_size / 64;
+	}
+
+	memset(zeromap, 0, (zeromap_lines + 31) / 32 * sizeof(*zeromap));
+	for (line = (image_len + 63) / 64; line < zeromap_lines; line++)
+		zeromap[line / 32] |= 1u << (line % 32);
+}
+
+/*
+ * Read the first len bytes of RAM from the read only mapping at image
+ * until they are written, instead of RAM. A partial last line has to be
+ * in RAM as well. NULL for none. Returns -1 if the whole image has to
+ * be copied to RAM after all.
+ */
+int cache_rom(const void *image, uint32_t len)
+{
+	free(rom_copied);
+	rom_copied = NULL;
+	rom = NULL;
+	rom_len = 0;
+	if (!image)
+		return 0;
+
+	rom_copied = calloc(((len >> ROM_PAGE_SHIFT) + 32) / 32, sizeof(*rom_copied));
+	if (!rom_copied)
+		return -1;
+	rom = image;
+	rom_len = len & ~0x3f;
+	return 0;
+}
+
+void cache_get_rom(uint64_t *preads, uint64_t *pcopies)
+{
+	*preads = rom_reads;
+	*pcopies = rom_copies;
+}
+
+void cache_get_zero(uint64_t *preads, uint64_t *pmarked)
+{
+	*preads = zero_reads;
+	*pmarked = zero_marked;
+}
+
+void cache_get_clean(uint64_t *pcleaned, uint64_t *pclean_evictions)
+{
+	*pcleaned = cleaned;
+	*pclean_evictions = clean_evictions;
+}
+
+/*
+ * The lines are private to one thread, so harts running on several threads
+ * must not use them: with ram set, every access goes to it directly.
+ */
+void cache_bypass(void *ram)
+{
+	bypass = ram;
+}
+
 void cache_get_stat(uint64_t *phit, uint64_t *paccessed)
 {
 	*phit = hit;
 	*paccessed = accessed;
 }
+
+uint64_t cache_get_writebacks(void)
+{
+	return writebacks;
+}
+
+void cache_get_psram(uint64_t *pread, uint64_t *pwritten)
+{
+	*pread = psram_rd;
+	*pwritten = psram_wr;
+}
+
+uint64_t cache_get_splits(void)
+{
+	return splits;
+}
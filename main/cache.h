@@ -11,6 +11,30 @@
 
 void cache_write(uint32_t ofs, void *buf, uint32_t size);
 void cache_read(uint32_t ofs, void *buf, uint32_t size);
+void cache_read_buf(uint32_t ofs, void *buf, uint32_t size);
+void cache_write_buf(uint32_t ofs, void *buf, uint32_t size);
+/* Bulk memmove() and memset() of guest RAM that leave the cache as it is */
+void cache_move(uint32_t dst, uint32_t src, uint32_t len);
+void cache_set(uint32_t dst, uint8_t c, uint32_t len);
+void cache_bypass(void *ram);
+/* Serve the first len bytes of RAM from a read only image until written, see cache.c */
+int cache_rom(const void *image, uint32_t len);
+/* line reads served from the image, and pages of it copied to RAM on a write */
+void cache_get_rom(uint64_t *preads, uint64_t *pcopies);
+/* RAM was (re)loaded with image_len bytes, the rest of it reads as zero */
+void cache_zero_init(uint32_t ram_size, uint32_t image_len);
+/* line reads served as zero without PSRAM, and lines cache_set() marked zero */
+void cache_get_zero(uint64_t *preads, uint64_t *pmarked);
+/* Write dirty lines back for at most budget_us, for when the guest is idle */
+void cache_clean(uint32_t budget_us);
+/* lines cache_clean() wrote back, and how many of them were evicted without a writeback */
+void cache_get_clean(uint64_t *pcleaned, uint64_t *pclean_evictions);
 void cache_get_stat(uint64_t *phit, uint64_t *paccessed);
+/* dirty lines written back to PSRAM */
+uint64_t cache_get_writebacks(void);
+/* bytes the cache, its bulk paths included, moved from and to PSRAM */
+void cache_get_psram(uint64_t *pread, uint64_t *pwritten);
+/* accesses that crossed into the next line */
+uint64_t cache_get_splits(void);
 
 #endif /* CACHE_H */
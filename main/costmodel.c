@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "costmodel.h"
+#include "psram.h"
+
+enum {
+	INSN_ALU,
+	INSN_MULDIV,
+	INSN_BRANCH,
+	INSN_JUMP,
+	INSN_LOAD,
+	INSN_STORE,
+	INSN_AMO,
+	INSN_SYSTEM,
+	INSN_NCLASSES,
+};
+
+static const char *const class_names[INSN_NCLASSES] = {
+	"alu", "muldiv", "branch", "jump", "load", "store", "amo", "system",
+};
+
+/*
+ * Defaults for mini-rv32ima built with -O2 on the 160MHz ESP32-C3, in CPU
+ * cycles per guest instruction. Loads and stores include the cache lookup,
+ * a miss adds the PSRAM fill on top. Calibrate against a board with -m.
+ */
+static uint32_t class_cycles[INSN_NCLASSES] = {
+	[INSN_ALU] = 40,
+	[INSN_MULDIV] = 60,
+	[INSN_BRANCH] = 45,
+	[INSN_JUMP] = 45,
+	[INSN_LOAD] = 75,
+	[INSN_STORE] = 80,
+	[INSN_AMO] = 150,
+	[INSN_SYSTEM] = 120,
+};
+
+static uint32_t cpu_mhz = 160;
+static uint32_t spi_mhz = 80;
+static int spi_mode = PSRAM_SPI;
+/* CS, driver and DMA setup of one transaction */
+static uint32_t setup_ns = 1000;
+
+__vm uint64_t cost_insns[256];
+
+static int insn_class(int op)
+{
+	switch (op & 0x7f) {
+	case 0x37:	// LUI
+	case 0x17:	// AUIPC
+	case 0x13:	// OP-IMM
+		return INSN_ALU;
+	case 0x33:	// OP
+		return op & 0x80 ? INSN_MULDIV : INSN_ALU;
+	case 0x63:
+		return INSN_BRANCH;
+	case 0x6f:	// JAL
+	case 0x67:	// JALR
+		return INSN_JUMP;
+	case 0x03:
+		return INSN_LOAD;
+	case 0x23:
+		return INSN_STORE;
+	case 0x2f:
+		return INSN_AMO;
+	default:	// CSR, fences and whatever traps
+		return INSN_SYSTEM;
+	}
+}
+
+uint64_t cost_insn_count(void)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		n += cost_insns[i];
+	return n;
+}
+
+int cost_parse(char *arg)
+{
+	char *key, *val;
+	int i;
+
+	for (key = strtok(arg, ","); key; key = strtok(NULL, ",")) {
+		val = strchr(key, '=');
+		if (!val)
+			return -1;
+		*val++ = 0;
+
+		if (!strcmp(key, "cpu")) {
+			cpu_mhz = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "spi")) {
+			spi_mhz = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "setup")) {
+			setup_ns = strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "mode")) {
+			if (!strcmp(val, "qpi"))
+				spi_mode = PSRAM_QPI;
+			else if (!strcmp(val, "spi"))
+				spi_mode = PSRAM_SPI;
+			else
+				return -1;
+		} else {
+			for (i = 0; i < INSN_NCLASSES; i++)
+				if (!strcmp(key, class_names[i]))
+					break;
+			if (i == INSN_NCLASSES)
+				return -1;
+			class_cycles[i] = strtoul(val, NULL, 0);
+		}
+	}
+
+	if (!cpu_mhz || !spi_mhz)
+		return -1;
+	return 0;
+}
+
+void cost_usage(FILE *f)
+{
+	int i;
+
+	fprintf(f, "               keys: cpu=%"PRIu32" spi=%"PRIu32" (MHz) mode=%s setup=%"PRIu32" (ns)\n",
+		cpu_mhz, spi_mhz, psram_xports[spi_mode].name, setup_ns);
+	fprintf(f, "               and cycles per instruction:");
+	for (i = 0; i < INSN_NCLASSES; i++)
+		fprintf(f, " %s=%"PRIu32, class_names[i], class_cycles[i]);
+	fprintf(f, "\n");
+}
+
+/* Predicted time of the transfers in one direction, in ns */
+static uint64_t psram_ns(const struct cost_psram *ps, int write)
+{
+	const struct psram_xport *x = &psram_xports[spi_mode];
+	uint64_t clocks;
+
+	// the transfers are counted as they were split, only the framing changes
+	clocks = ps->xfers[write] * psram_clocks(x, 0, write) +
+		 ps->payload[write] * 8 / x->data_lines;
+	return ps->xfers[write] * setup_ns + clocks * 1000 / spi_mhz;
+}
+
+static void line(FILE *f, const char *name, uint64_t ns, uint64_t total)
+{
+	fprintf(f, "  %-14s %10"PRIu64" ms %5.1f%%\n", name, ns / 1000000,
+		total ? 100.0 * ns / total : 0.0);
+}
+
+void cost_report(FILE *f, const struct cost_psram *ps)
+{
+	uint64_t insns[INSN_NCLASSES] = { 0 }, interp_ns = 0, fill_ns, wb_ns, total, n = 0;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		insns[insn_class(i)] += cost_insns[i];
+
+	fprintf(f, "cost model: %"PRIu32" MHz CPU, %s at %"PRIu32" MHz, %"PRIu32" ns per transaction\n",
+		cpu_mhz, psram_xports[spi_mode].name, spi_mhz, setup_ns);
+	for (i = 0; i < INSN_NCLASSES; i++) {
+		interp_ns += insns[i] * class_cycles[i] * 1000 / cpu_mhz;
+		n += insns[i];
+	}
+	fprintf(f, "  %"PRIu64" instructions:", n);
+	for (i = 0; i < INSN_NCLASSES; i++)
+		fprintf(f, " %s %"PRIu64, class_names[i], insns[i]);
+	fprintf(f, "\n");
+	for (i = 0; i < 2; i++)
+		fprintf(f, "  psram %-6s %"PRIu64" transfers, %"PRIu64" overhead and %"PRIu64" payload bytes\n",
+			i ? "writes" : "reads", ps->xfers[i], ps->overhead[i], ps->payload[i]);
+
+	fill_ns = psram_ns(ps, 0);
+	wb_ns = psram_ns(ps, 1);
+	total = interp_ns + fill_ns + wb_ns;
+	fprintf(f, "  predicted %"PRIu64" ms on the device\n", total / 1000000);
+	line(f, "interpretation", interp_ns, total);
+	line(f, "PSRAM fills", fill_ns, total);
+	line(f, "writebacks", wb_ns, total);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "port.h"
+
+/*
+ * Predicts how long a run on the host would take on an ESP32-C3, from the
+ * instructions the guest executed and the PSRAM transfers they caused.
+ * Only the posix port counts them, see CONFIG_COSTMODEL.
+ */
+
+/* PSRAM traffic by direction, reads are cache fills and writes writebacks */
+struct cost_psram {
+	uint64_t xfers[2];
+	/* command, address and wait bytes on the bus */
+	uint64_t overhead[2];
+	uint64_t payload[2];
+};
+
+/* executed instructions by major opcode, bit 7 is funct7 bit 0 for the M extension */
+extern __vm uint64_t cost_insns[256];
+
+static inline void cost_insn(uint32_t ir)
+{
+	cost_insns[(ir & 0x7f) | ((ir >> 18) & 0x80)]++;
+}
+
+/* Instructions executed so far */
+uint64_t cost_insn_count(void);
+/* Parse key=value[,key=value...], returns -1 on an unknown key */
+int cost_parse(char *arg);
+void cost_usage(FILE *f);
+void cost_report(FILE *f, const struct cost_psram *ps);
+
+#endif /* COSTMODEL_H */
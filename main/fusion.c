@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "fusion.h"
+
+/* major opcode, funct3, RV32M and the funct7 bit of SUB and SRA */
+#define CLASSES			1024
+/* pairs printed by fusion_report() */
+#define TOP_PAIRS		24
+
+int fusion_on;
+int fusion_hist;
+__vm uint64_t fusion_count[FUSE_KINDS];
+
+static __vm uint64_t *pairs;
+static __vm uint32_t prev;
+
+static const char *const fuse_names[FUSE_KINDS] = {
+	[FUSE_LUI_ADDI] = "lui+addi",
+	[FUSE_AUIPC_ADDI] = "auipc+addi",
+	[FUSE_AUIPC_JALR] = "auipc+jalr",
+	[FUSE_AUIPC_LW] = "auipc+lw",
+	[FUSE_SLLI_SRLI] = "slli+srli",
+};
+
+static uint32_t insn_class(uint32_t ir)
+{
+	uint32_t op = ir & 0x7f, f3 = (ir >> 12) & 7;
+
+	switch (op) {
+	case 0x37:
+	case 0x17:
+	case 0x6f:
+		f3 = 0;
+		break;
+	case 0x33:
+		if (ir & (1 << 25))
+			return (op >> 2) | f3 << 5 | 1 << 8;
+		/* fall through */
+	case 0x13:
+		if ((f3 == 5 || (f3 == 0 && op == 0x33)) && (ir & (1 << 30)))
+			return (op >> 2) | f3 << 5 | 1 << 9;
+		break;
+	}
+
+	return (op >> 2) | f3 << 5;
+}
+
+static const char *class_name(uint32_t c, char *buf)
+{
+	static const char *const branch[8] = { "beq", "bne", "b?", "b?", "blt", "bge", "bltu", "bgeu" };
+	static const char *const load[8] = { "lb", "lh", "lw", "l?", "lbu", "lhu", "l?", "l?" };
+	static const char *const store[8] = { "sb", "sh", "sw", "s?", "s?", "s?", "s?", "s?" };
+	static const char *const opimm[8] = { "addi", "slli", "slti", "sltiu", "xori", "srli", "ori", "andi" };
+	static const char *const op[8] = { "add", "sll", "slt", "sltu", "xor", "srl", "or", "and" };
+	static const char *const muldiv[8] = { "mul", "mulh", "mulhsu", "mulhu", "div", "divu", "rem", "remu" };
+	static const char *const csr[8] = { "system", "csrrw", "csrrs", "csrrc", "csr?", "csrrwi", "csrrsi", "csrrci" };
+	uint32_t f3 = (c >> 5) & 7;
+
+	switch (((c & 0x1f) << 2) | 3) {
+	case 0x37: return "lui";
+	case 0x17: return "auipc";
+	case 0x6f: return "jal";
+	case 0x67: return "jalr";
+	case 0x63: return branch[f3];
+	case 0x03: return load[f3];
+	case 0x23: return store[f3];
+	case 0x13:
+		return (c & (1 << 9)) ? "srai" : opimm[f3];
+	case 0x33:
+		if (c & (1 << 8))
+			return muldiv[f3];
+		if (c & (1 << 9))
+			return f3 ? "sra" : "sub";
+		return op[f3];
+	case 0x73: return csr[f3];
+	case 0x2f: return "amo";
+	case 0x0f: return "fence";
+	}
+
+	sprintf(buf, "op%02"PRIx32, ((c & 0x1f) << 2) | 3);
+	return buf;
+}
+
+void fusion_pair(uint32_t ir)
+{
+	uint32_t c = insn_class(ir);
+
+	if (!pairs) {
+		pairs = calloc(CLASSES * CLASSES, sizeof(*pairs));
+		if (!pairs) {
+			fusion_hist = 0;
+			return;
+		}
+	}
+	pairs[prev * CLASSES + c]++;
+	prev = c;
+}
+
+void fusion_report(FILE *f)
+{
+	uint32_t top[TOP_PAIRS] = { 0 };
+	uint64_t total = 0;
+	char b1[8], b2[8];
+	int i, j, n = 0;
+	uint32_t p;
+
+	if (fusion_on) {
+		fprintf(f, "fused:");
+		for (i = 0; i < FUSE_KINDS; i++)
+			fprintf(f, " %s %"PRIu64, fuse_names[i], fusion_count[i]);
+		fprintf(f, "\n");
+	}
+
+	if (!pairs)
+		return;
+
+	// keep the most frequent pairs, sorted, by insertion
+	for (p = 0; p < CLASSES * CLASSES; p++) {
+		total += pairs[p];
+		if (!pairs[p] || (n == TOP_PAIRS && pairs[p] <= pairs[top[n - 1]]))
+			continue;
+		for (i = n < TOP_PAIRS ? n++ : n - 1; i > 0 && pairs[top[i - 1]] < pairs[p]; i--)
+			top[i] = top[i - 1];
+		top[i] = p;
+	}
+
+	fprintf(f, "instruction pairs, %"PRIu64" in all:\n", total);
+	for (j = 0; j < n; j++) {
+		p = top[j];
+		fprintf(f, "  %-8s %-8s %12"PRIu64" %5.2f%%\n", class_name(p / CLASSES, b1),
+			class_name(p % CLASSES, b2), pairs[p], 100.0 * pairs[p] / total);
+	}
+}
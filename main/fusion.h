@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef FUSION_H
+#define FUSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "port.h"
+
+/* instruction pairs the core runs as one, see MINIRV32_FUSION */
+enum fuse_kind {
+	FUSE_LUI_ADDI,
+	FUSE_AUIPC_ADDI,
+	FUSE_AUIPC_JALR,
+	FUSE_AUIPC_LW,
+	FUSE_SLLI_SRLI,
+	FUSE_KINDS,
+};
+
+#ifdef CONFIG_FUSION
+/* 0, the default, runs every instruction on its own */
+extern int fusion_on;
+/* count pairs of consecutive instructions, to find what is worth fusing */
+extern int fusion_hist;
+extern __vm uint64_t fusion_count[FUSE_KINDS];
+
+static inline void fusion_fused(uint32_t ir, uint32_t ir2)
+{
+	enum fuse_kind k;
+
+	if ((ir & 0x7f) == 0x13)
+		k = FUSE_SLLI_SRLI;
+	else if ((ir2 & 0x7f) == 0x13)
+		k = (ir & 0x20) ? FUSE_LUI_ADDI : FUSE_AUIPC_ADDI;
+	else if ((ir2 & 0x7f) == 0x67)
+		k = FUSE_AUIPC_JALR;
+	else
+		k = FUSE_AUIPC_LW;
+	fusion_count[k]++;
+}
+
+void fusion_pair(uint32_t ir);
+
+static inline void fusion_insn(uint32_t ir)
+{
+	if (__builtin_expect(fusion_hist, 0))
+		fusion_pair(ir);
+}
+
+void fusion_report(FILE *f);
+#else
+static inline void fusion_report(FILE *f) { }
+#endif
+
+#endif /* FUSION_H */
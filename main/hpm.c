@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+
+#include "cache.h"
+#include "hpm.h"
+
+#define CSR_MCOUNTINHIBIT	0x320
+#define CSR_MHPMEVENT3		0x323
+#define CSR_MCYCLE		0xb00
+#define CSR_MINSTRET		0xb02
+#define CSR_MHPMCOUNTER3	0xb03
+#define CSR_MCYCLEH		0xb80
+#define CSR_MINSTRETH		0xb82
+#define CSR_MHPMCOUNTER3H	0xb83
+#define CSR_INSTRET		0xc02
+#define CSR_HPMCOUNTER3		0xc03
+#define CSR_CYCLEH		0xc80
+#define CSR_INSTRETH		0xc82
+#define CSR_HPMCOUNTER3H	0xc83
+
+__vm uint64_t hpm_traps, hpm_mmio;
+
+/*
+ * Nothing is counted per counter: a counter is the value it had when it
+ * was last written, stopped or given a new event, plus how far the event
+ * total moved on since then.
+ */
+static __vm uint32_t events[HPM_COUNTERS];
+static __vm uint64_t base[HPM_COUNTERS], start[HPM_COUNTERS];
+static __vm uint32_t inhibit;
+
+static uint64_t hpm_total(uint32_t event, uint64_t instret)
+{
+	uint64_t hit, accessed, rd, wr;
+
+	switch (event) {
+	case HPM_EV_INSNS:
+		return instret;
+	case HPM_EV_TRAP:
+		return hpm_traps;
+	case HPM_EV_MMIO:
+		return hpm_mmio;
+	case HPM_EV_WRITEBACK:
+		return cache_get_writebacks();
+	case HPM_EV_PSRAM_READ:
+		cache_get_psram(&rd, &wr);
+		return rd;
+	case HPM_EV_PSRAM_WRITE:
+		cache_get_psram(&rd, &wr);
+		return wr;
+	default:
+		break;
+	}
+
+	cache_get_stat(&hit, &accessed);
+	switch (event) {
+	case HPM_EV_CACHE_HIT:
+		return hit;
+	case HPM_EV_CACHE_MISS:
+		return accessed - hit;
+	default:
+		return 0;
+	}
+}
+
+static uint64_t hpm_get(int i, uint64_t instret)
+{
+	if (inhibit & (1 << (i + 3)))
+		return base[i];
+	return base[i] + hpm_total(events[i], instret) - start[i];
+}
+
+static void hpm_set(int i, uint64_t val, uint64_t instret)
+{
+	base[i] = val;
+	start[i] = hpm_total(events[i], instret);
+}
+
+int hpm_csr_read(uint16_t csrno, uint64_t cycle, uint64_t instret, uint32_t *val)
+{
+	uint16_t i;
+
+	switch (csrno) {
+	case CSR_MCOUNTINHIBIT:
+		*val = inhibit;
+		return 0;
+	case CSR_MCYCLE:
+		*val = cycle;
+		return 0;
+	case CSR_MCYCLEH:
+	case CSR_CYCLEH:
+		*val = cycle >> 32;
+		return 0;
+	case CSR_MINSTRET:
+	case CSR_INSTRET:
+		*val = instret;
+		return 0;
+	case CSR_MINSTRETH:
+	case CSR_INSTRETH:
+		*val = instret >> 32;
+		return 0;
+	default:
+		break;
+	}
+
+	if ((i = csrno - CSR_MHPMEVENT3) < 29)
+		*val = i < HPM_COUNTERS ? events[i] : 0;
+	else if ((i = csrno - CSR_MHPMCOUNTER3) < 29 || (i = csrno - CSR_HPMCOUNTER3) < 29)
+		*val = i < HPM_COUNTERS ? hpm_get(i, instret) : 0;
+	else if ((i = csrno - CSR_MHPMCOUNTER3H) < 29 || (i = csrno - CSR_HPMCOUNTER3H) < 29)
+		*val = i < HPM_COUNTERS ? hpm_get(i, instret) >> 32 : 0;
+	else
+		return -1;
+
+	return 0;
+}
+
+int hpm_csr_write(uint16_t csrno, uint64_t instret, uint32_t val)
+{
+	uint64_t v[HPM_COUNTERS];
+	uint16_t i;
+
+	switch (csrno) {
+	case CSR_MCOUNTINHIBIT:
+		for (i = 0; i < HPM_COUNTERS; i++)
+			v[i] = hpm_get(i, instret);
+		// cycle and instret always run
+		inhibit = val & ((1ULL << (HPM_COUNTERS + 3)) - 8);
+		for (i = 0; i < HPM_COUNTERS; i++)
+			hpm_set(i, v[i], instret);
+		return 0;
+	// they are the guest's cycle and instruction counts, which it can't change
+	case CSR_MCYCLE:
+	case CSR_MINSTRET:
+	case CSR_MCYCLEH:
+	case CSR_MINSTRETH:
+		return 0;
+	default:
+		break;
+	}
+
+	if ((i = csrno - CSR_MHPMEVENT3) < 29) {
+		if (i >= HPM_COUNTERS)
+			return 0;
+		v[0] = hpm_get(i, instret);
+		events[i] = val < HPM_NR_EVENTS ? val : HPM_EV_NONE;
+		hpm_set(i, v[0], instret);
+	} else if ((i = csrno - CSR_MHPMCOUNTER3) < 29) {
+		if (i < HPM_COUNTERS)
+			hpm_set(i, (hpm_get(i, instret) & ~0xffffffffULL) | val, instret);
+	} else if ((i = csrno - CSR_MHPMCOUNTER3H) < 29) {
+		if (i < HPM_COUNTERS)
+			hpm_set(i, (hpm_get(i, instret) & 0xffffffffULL) | ((uint64_t)val << 32), instret);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef HPM_H
+#define HPM_H
+
+#include <stdint.h>
+
+#include "port.h"
+
+/* mhpmcounter3 and up, the others read as zero */
+#define HPM_COUNTERS		8
+
+/* mhpmevent values, anything else reads back as HPM_EV_NONE */
+enum hpm_event {
+	HPM_EV_NONE,
+	HPM_EV_INSNS,		/* retired instructions */
+	HPM_EV_CACHE_HIT,
+	HPM_EV_CACHE_MISS,
+	HPM_EV_WRITEBACK,	/* dirty lines written back */
+	HPM_EV_PSRAM_READ,	/* bytes read from PSRAM by the cache */
+	HPM_EV_PSRAM_WRITE,	/* bytes written to PSRAM by the cache */
+	HPM_EV_TRAP,		/* exceptions and interrupts taken */
+	HPM_EV_MMIO,		/* loads and stores that left RAM */
+	HPM_NR_EVENTS,
+};
+
+/* counted by the core, see MINIRV32_TRAP and BusRead() */
+extern __vm uint64_t hpm_traps, hpm_mmio;
+
+/*
+ * Counter CSRs beyond cycle, which the core has itself. cycle and instret
+ * are the current counts, the core only stores them at the end of a slice.
+ * cycle runs on while the hart waits in WFI, instret doesn't. Both return
+ * -1 if csrno is not one of them.
+ */
+int hpm_csr_read(uint16_t csrno, uint64_t cycle, uint64_t instret, uint32_t *val);
+int hpm_csr_write(uint16_t csrno, uint64_t instret, uint32_t val);
+
+#endif /* HPM_H */
@@ -53,6 +53,45 @@
 	#define MINIRV32_OTHERCSR_READ(...);
 #endif
 
+// Called with every instruction fetched, for statistics.
+#ifndef MINIRV32_INSN
+	#define MINIRV32_INSN( ir );
+#endif
+
+// Called when a trap or interrupt is taken, for statistics.
+#ifndef MINIRV32_TRAP
+	#define MINIRV32_TRAP( trap );
+#endif
+
+// Called with both words when MINIRV32_FUSION ran a pair as one, for statistics.
+#ifndef MINIRV32_FUSED
+	#define MINIRV32_FUSED( ir, ir2 );
+#endif
+
+// Fusion can be turned off at run time by making this 0.
+#ifndef MINIRV32_FUSION_ON
+	#define MINIRV32_FUSION_ON 1
+#endif
+
+// Called when MRET returns from a trap, for statistics.
+#ifndef MINIRV32_MRET
+	#define MINIRV32_MRET();
+#endif
+
+// Atomics, for hosts that run several harts on shared RAM. CAS4 stores val
+// only if the word still holds old, LR4/SC4 let the host track reservations.
+#ifndef MINIRV32_CAS4
+	#define MINIRV32_CAS4( ofs, old, val ) ( MINIRV32_STORE4( ofs, val ), 1 )
+#endif
+
+#ifndef MINIRV32_LR4
+	#define MINIRV32_LR4( ofs, val );
+#endif
+
+#ifndef MINIRV32_SC4
+	#define MINIRV32_SC4( ofs, val ) ( MINIRV32_STORE4( ofs, val ), 1 )
+#endif
+
 #ifndef MINIRV32_CUSTOM_MEMORY_BUS
 	#define MINIRV32_STORE4( ofs, val ) *(uint32_t*)(image + ofs) = val
 	#define MINIRV32_STORE2( ofs, val ) *(uint16_t*)(image + ofs) = val
@@ -120,6 +159,10 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 	else
 		CSR( mip ) &= ~(1<<7);
 
+	// A pending external or software interrupt (MEIP/MSIP, driven by the host) wakes us up too.
+	if( CSR( mip ) & ((1<<11) | (1<<3)) )
+		CSR( extraflags ) &= ~4;
+
 	// If WFI, don't run processor.
 	if( CSR( extraflags ) & 4 )
 		return 1;
@@ -128,8 +171,24 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 	uint32_t rval = 0;
 	uint32_t pc = CSR( pc );
 	uint32_t cycle = CSR( cyclel );
+#ifdef MINIRV32_FUSION
+	// the word after a pair head that did not fuse, it is next to run
+	uint32_t next_ir = 0, have_next = 0;
+#endif
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	if( ( CSR( mip ) & (1<<11) ) && ( CSR( mie ) & (1<<11) /*meie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	{
+		// External interrupt, takes priority over the timer.
+		trap = 0x8000000b;
+		pc -= 4;
+	}
+	else if( ( CSR( mip ) & (1<<3) ) && ( CSR( mie ) & (1<<3) /*msie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	{
+		// Software interrupt (IPI), also before the timer.
+		trap = 0x80000003;
+		pc -= 4;
+	}
+	else if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
 		// Timer interrupt.
 		trap = 0x80000007;
@@ -155,9 +214,80 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 		}
 		else
 		{
+#ifdef MINIRV32_FUSION
+			if( have_next )
+			{
+				ir = next_ir;
+				have_next = 0;
+			}
+			else
+#endif
 			ir = MINIRV32_LOAD4( ofs_pc );
+			MINIRV32_INSN( ir );
 			uint32_t rdid = (ir >> 7) & 0x1f;
 
+#ifdef MINIRV32_FUSION
+			// Macro-op fusion: LUI, AUIPC or SLLI followed by an instruction that
+			// consumes its result runs as one. The head never traps and the pair
+			// never straddles the end of the slice, where interrupts are taken,
+			// so it is exact as long as the tail can't trap either. A load tail
+			// is only fused when it hits RAM, anything else runs on its own.
+			if( rdid && ( ( ir & 0x5f ) == 0x17 || ( ir & 0xfe00707f ) == 0x1013 ) &&
+				icount + 1 < count && ofs_pc + 4 < MINI_RV32_RAM_SIZE && MINIRV32_FUSION_ON )
+			{
+				uint32_t ir2 = MINIRV32_LOAD4( ofs_pc + 4 );
+				uint32_t rd2 = ( ir2 >> 7 ) & 0x1f;
+				int32_t imm2 = (int32_t)ir2 >> 20;
+				// LUI or AUIPC result
+				uint32_t hi = ( ir & 0xfffff000 ) + ( ( ir & 0x20 ) ? 0 : pc );
+				int fused = 1;
+
+				if( ( ( ir2 >> 15 ) & 0x1f ) != rdid )
+					fused = 0;
+				else if( ( ir & 0x7f ) == 0x13 )
+				{
+					// SLLI + SRLI, zero extension
+					if( ( ir2 & 0xfe00707f ) == 0x5013 && rd2 == rdid )
+						REGSET( rdid, ( REG( ( ir >> 15 ) & 0x1f ) << ( ( ir >> 20 ) & 0x1f ) ) >> ( ( ir2 >> 20 ) & 0x1f ) )
+					else
+						fused = 0;
+				}
+				else if( ( ir2 & 0x707f ) == 0x13 && rd2 == rdid )
+				{
+					// LUI or AUIPC + ADDI, a constant or an address
+					REGSET( rdid, hi + imm2 );
+				}
+				else if( ( ir & 0x7f ) == 0x17 && ( ir2 & 0x707f ) == 0x67 )
+				{
+					// AUIPC + JALR, a far call or tail call
+					REGSET( rdid, hi );
+					if( rd2 ) REGSET( rd2, pc + 8 );
+					pc = ( ( hi + imm2 ) & ~1 ) - 8;
+				}
+				else if( ( ir & 0x7f ) == 0x17 && ( ir2 & 0x707f ) == 0x2003 &&
+					hi + imm2 - MINIRV32_RAM_IMAGE_OFFSET < MINI_RV32_RAM_SIZE-3 )
+				{
+					// AUIPC + LW, a PC relative load
+					REGSET( rdid, hi );
+					if( rd2 ) REGSET( rd2, MINIRV32_LOAD4( hi + imm2 - MINIRV32_RAM_IMAGE_OFFSET ) );
+				}
+				else
+					fused = 0;
+
+				if( fused )
+				{
+					MINIRV32_INSN( ir2 );
+					MINIRV32_FUSED( ir, ir2 );
+					cycle++;
+					icount++;
+					pc += 8;
+					continue;
+				}
+				next_ir = ir2;
+				have_next = 1;
+			}
+#endif
+
 			switch( ir & 0x7f )
 			{
 				case 0b0110111: // LUI
@@ -214,14 +344,17 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					if( rsval >= MINI_RV32_RAM_SIZE-3 )
 					{
 						rsval += MINIRV32_RAM_IMAGE_OFFSET;
-						if( rsval >= 0x10000000 && rsval < 0x12000000 )  // UART, CLNT
+						if( rsval >= 0x10000000 && rsval < 0x12000000 )  // UART, CLNT, ...
 						{
-							if( rsval == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
-								rval = CSR( timerh );
-							else if( rsval == 0x1100bff8 )
-								rval = CSR( timerl );
-							else
-								MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
+							MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
+							// Devices return 32 bits, narrow it to the access width.
+							switch( ( ir >> 12 ) & 0x7 )
+							{
+								case 0b000: rval = (int8_t)rval; break;
+								case 0b001: rval = (int16_t)rval; break;
+								case 0b100: rval = (uint8_t)rval; break;
+								case 0b101: rval = (uint16_t)rval; break;
+							}
 						}
 						else
 						{
@@ -259,17 +392,7 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 						if( addy >= 0x10000000 && addy < 0x12000000 )
 						{
 							// Should be stuff like SYSCON, 8250, CLNT
-							if( addy == 0x11004004 ) //CLNT
-								CSR( timermatchh ) = rs2;
-							else if( addy == 0x11004000 ) //CLNT
-								CSR( timermatchl ) = rs2;
-							else if( addy == 0x11100000 ) //SYSCON (reboot, poweroff, etc.)
-							{
-								SETCSR( pc, pc + 4 );
-								return rs2; // NOTE: PC will be PC of Syscon.
-							}
-							else
-								MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
+							MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
 						}
 						else
 						{
@@ -377,27 +500,29 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 							case 0b111: writeval = rval & ~rs1imm; break;	//CSRRCI
 						}
 
-						switch( csrno )
-						{
-						case 0x340: SETCSR( mscratch, writeval ); break;
-						case 0x305: SETCSR( mtvec, writeval ); break;
-						case 0x304: SETCSR( mie, writeval ); break;
-						case 0x344: SETCSR( mip, writeval ); break;
-						case 0x341: SETCSR( mepc, writeval ); break;
-						case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
-						case 0x342: SETCSR( mcause, writeval ); break;
-						case 0x343: SETCSR( mtval, writeval ); break;
-						//case 0x3a0: break; //pmpcfg0
-						//case 0x3B0: break; //pmpaddr0
-						//case 0xf11: break; //mvendorid
-						//case 0xf12: break; //marchid
-						//case 0xf13: break; //mimpid
-						//case 0xf14: break; //mhartid
-						//case 0x301: break; //misa
-						default:
-							MINIRV32_OTHERCSR_WRITE( csrno, writeval );
-							break;
-						}
+						// CSRRS and CSRRC with x0 or 0 only read, csrr must not write the CSR back.
+						if( !( ( microop & 2 ) && rs1imm == 0 ) )
+							switch( csrno )
+							{
+							case 0x340: SETCSR( mscratch, writeval ); break;
+							case 0x305: SETCSR( mtvec, writeval ); break;
+							case 0x304: SETCSR( mie, writeval ); break;
+							case 0x344: SETCSR( mip, writeval ); break;
+							case 0x341: SETCSR( mepc, writeval ); break;
+							case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
+							case 0x342: SETCSR( mcause, writeval ); break;
+							case 0x343: SETCSR( mtval, writeval ); break;
+							//case 0x3a0: break; //pmpcfg0
+							//case 0x3B0: break; //pmpaddr0
+							//case 0xf11: break; //mvendorid
+							//case 0xf12: break; //marchid
+							//case 0xf13: break; //mimpid
+							//case 0xf14: break; //mhartid
+							//case 0x301: break; //misa
+							default:
+								MINIRV32_OTHERCSR_WRITE( csrno, writeval );
+								break;
+							}
 					}
 					else if( microop == 0b000 ) // "SYSTEM"
 					{
@@ -419,6 +544,7 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 							SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
 							SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
 							pc = CSR( mepc ) -4;
+							MINIRV32_MRET();
 						}
 						else
 						{
@@ -451,32 +577,41 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 					}
 					else
 					{
-						rval = MINIRV32_LOAD4( rs1 );
+						uint32_t dowrite;
+						uint32_t nval;
 
-						// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
-						uint32_t dowrite = 1;
-						switch( irmid )
+						// Retry until nobody else changed the word between the load and the store.
+						do
 						{
-							case 0b00010: //LR.W
-								dowrite = 0;
-								CSR( extraflags ) = (CSR( extraflags ) & 0b111) | (rs1<<3);
-								break;
-							case 0b00011:  //SC.W (Make sure we have a slot, and, it's valid)
-								rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
-								dowrite = !rval; // Only write if slot is valid.
-								break;
-							case 0b00001: break; //AMOSWAP.W
-							case 0b00000: rs2 += rval; break; //AMOADD.W
-							case 0b00100: rs2 ^= rval; break; //AMOXOR.W
-							case 0b01100: rs2 &= rval; break; //AMOAND.W
-							case 0b01000: rs2 |= rval; break; //AMOOR.W
-							case 0b10000: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W
-							case 0b10100: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W
-							case 0b11000: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W
-							case 0b11100: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W
-							default: trap = (2+1); dowrite = 0; break; //Not supported.
-						}
-						if( dowrite ) MINIRV32_STORE4( rs1, rs2 );
+							rval = MINIRV32_LOAD4( rs1 );
+							nval = rs2;
+
+							// Referenced a little bit of https://github.com/franzflasch/riscv_em/blob/master/src/core/core.c
+							dowrite = 1;
+							switch( irmid )
+							{
+								case 0b00010: //LR.W
+									dowrite = 0;
+									CSR( extraflags ) = (CSR( extraflags ) & 0b111) | (rs1<<3);
+									MINIRV32_LR4( rs1, rval );
+									break;
+								case 0b00011:  //SC.W (Make sure we have a slot, and, it's valid)
+									dowrite = 0;
+									rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
+									if( !rval ) rval = !MINIRV32_SC4( rs1, nval ); // Only write if slot is valid.
+									break;
+								case 0b00001: break; //AMOSWAP.W
+								case 0b00000: nval += rval; break; //AMOADD.W
+								case 0b00100: nval ^= rval; break; //AMOXOR.W
+								case 0b01100: nval &= rval; break; //AMOAND.W
+								case 0b01000: nval |= rval; break; //AMOOR.W
+								case 0b10000: nval = ((int32_t)nval<(int32_t)rval)?nval:rval; break; //AMOMIN.W
+								case 0b10100: nval = ((int32_t)nval>(int32_t)rval)?nval:rval; break; //AMOMAX.W
+								case 0b11000: nval = (nval<rval)?nval:rval; break; //AMOMINU.W
+								case 0b11100: nval = (nval>rval)?nval:rval; break; //AMOMAXU.W
+								default: trap = (2+1); dowrite = 0; break; //Not supported.
+							}
+						} while( dowrite && !MINIRV32_CAS4( rs1, rval, nval ) );
 					}
 					break;
 				}
@@ -501,6 +636,7 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 	// Handle traps and interrupts.
 	if( trap )
 	{
+		MINIRV32_TRAP( trap );
 		if( trap & 0x80000000 ) // If prefixed with 1 in MSB, it's an interrupt, not a trap.
 		{
 			SETCSR( mcause, trap );
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mmio.h"
+#include "port.h"
+#include "trace.h"
+
+static __vm struct mmio_dev *devs[MMIO_MAX_DEVS];
+static __vm int nr_devs;
+/* index + 1 into devs[] for every 64KB page of the window, 0 if unused */
+static __vm uint8_t pages[MMIO_NR_PAGES];
+
+int mmio_register(struct mmio_dev *dev)
+{
+	uint32_t first, last, i;
+
+	if (nr_devs == MMIO_MAX_DEVS || !dev->size ||
+	    dev->base < MMIO_BASE || dev->base - MMIO_BASE + dev->size > MMIO_END - MMIO_BASE) {
+		printf("mmio: can't register %s\n", dev->name);
+		return -1;
+	}
+
+	first = (dev->base - MMIO_BASE) >> MMIO_PAGE_SHIFT;
+	last = (dev->base - MMIO_BASE + dev->size - 1) >> MMIO_PAGE_SHIFT;
+	for (i = first; i <= last; i++) {
+		if (pages[i]) {
+			printf("mmio: %s overlaps %s\n", dev->name, devs[pages[i] - 1]->name);
+			return -1;
+		}
+	}
+
+	devs[nr_devs++] = dev;
+	for (i = first; i <= last; i++)
+		pages[i] = nr_devs;
+
+	return 0;
+}
+
+static struct mmio_dev *mmio_find(uint32_t addr)
+{
+	struct mmio_dev *dev;
+	uint8_t idx;
+
+	idx = pages[(addr - MMIO_BASE) >> MMIO_PAGE_SHIFT];
+	if (!idx)
+		return NULL;
+
+	dev = devs[idx - 1];
+	if (addr - dev->base >= dev->size)
+		return NULL;
+
+	return dev;
+}
+
+/* addr is within [MMIO_BASE, MMIO_END), the core checked that */
+uint32_t mmio_read(uint32_t addr)
+{
+	struct mmio_dev *dev = mmio_find(addr);
+
+	if (!dev || !dev->read)
+		return 0;
+	trace(TRACE_MMIO_READ, pages[(addr - MMIO_BASE) >> MMIO_PAGE_SHIFT] - 1, addr - dev->base);
+	return dev->read(dev->opaque, addr - dev->base);
+}
+
+uint32_t mmio_write(uint32_t addr, uint32_t val)
+{
+	struct mmio_dev *dev = mmio_find(addr);
+
+	if (!dev || !dev->write)
+		return 0;
+	trace(TRACE_MMIO_WRITE, pages[(addr - MMIO_BASE) >> MMIO_PAGE_SHIFT] - 1, addr - dev->base);
+	return dev->write(dev->opaque, addr - dev->base, val);
+}
+
+const char *mmio_dev_name(int i)
+{
+	return i < nr_devs ? devs[i]->name : NULL;
+}
+
+/* The soc node contents for a device tree describing what is registered */
+void mmio_dump_dt(FILE *f)
+{
+	struct mmio_dev *dev;
+	int i;
+
+	for (i = 0; i < nr_devs; i++) {
+		dev = devs[i];
+		fprintf(f, "\t\t%s@%x {\n", dev->name, dev->base);
+		fprintf(f, "\t\t\treg = <0x00 0x%x 0x00 0x%x>;\n", dev->base, dev->size);
+		if (dev->compatible)
+			fprintf(f, "\t\t\tcompatible = %s;\n", dev->compatible);
+		if (dev->irq) {
+			fprintf(f, "\t\t\tinterrupts = <0x%02x>;\n", dev->irq);
+			fprintf(f, "\t\t\tinterrupt-parent = <0x%02x>;\n", DT_PHANDLE_PLIC);
+		}
+		if (dev->dt_props)
+			dev->dt_props(f, dev);
+		fprintf(f, "\t\t};\n\n");
+	}
+}
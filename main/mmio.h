@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* the window MiniRV32IMAStep() hands to us */
+#define MMIO_BASE		0x10000000
+#define MMIO_END		0x12000000
+
+/* lookup granule, at most one device per 64KB page */
+#define MMIO_PAGE_SHIFT		16
+#define MMIO_NR_PAGES		((MMIO_END - MMIO_BASE) >> MMIO_PAGE_SHIFT)
+#define MMIO_MAX_DEVS		16
+
+/* phandles shared by uc.dts and the generated device tree */
+#define DT_PHANDLE_CPU_INTC	0x02
+#define DT_PHANDLE_PLIC		0x03
+#define DT_PHANDLE_SYSCON	0x04
+/* interrupt controller of each hart, hart 0 keeps the one above */
+#define DT_PHANDLE_HART_INTC(h)	((h) ? 0x10 + (h) : DT_PHANDLE_CPU_INTC)
+
+struct mmio_dev {
+	const char *name;
+	const char *compatible;
+	uint32_t base;
+	uint32_t size;
+	/* PLIC source, 0 if none */
+	int irq;
+	void *opaque;
+	uint32_t (*read)(void *opaque, uint32_t ofs);
+	/* a non zero return value stops the core and is handed to the main loop */
+	uint32_t (*write)(void *opaque, uint32_t ofs, uint32_t val);
+	/* device tree properties beyond reg/compatible/interrupts, optional */
+	void (*dt_props)(FILE *f, struct mmio_dev *dev);
+};
+
+int mmio_register(struct mmio_dev *dev);
+uint32_t mmio_read(uint32_t addr);
+uint32_t mmio_write(uint32_t addr, uint32_t val);
+void mmio_dump_dt(FILE *f);
+/* name of the i-th registered device, NULL past the last one */
+const char *mmio_dev_name(int i);
+
+#endif /* MMIO_H */
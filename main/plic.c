@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mmio.h"
+#include "plic.h"
+#include "port.h"
+
+/*
+ * A minimal PLIC with one context per hart (M-mode), level triggered
+ * sources and 32 sources so that pending/enable fit in one word each.
+ */
+#define PLIC_PRIORITY		0x000000
+#define PLIC_PENDING		0x001000
+#define PLIC_ENABLE		0x002000
+#define PLIC_ENABLE_STRIDE	0x80
+#define PLIC_THRESHOLD		0x200000
+#define PLIC_CLAIM		0x200004
+#define PLIC_CONTEXT_STRIDE	0x1000
+
+static __vm uint32_t priority[PLIC_NR_IRQS];
+static __vm uint32_t level, pending, claimed;
+static __vm uint32_t enable[PLIC_MAX_CONTEXTS], threshold[PLIC_MAX_CONTEXTS];
+static __vm int nr_contexts;
+
+static int plic_best_irq(int ctx)
+{
+	uint32_t ready = pending & enable[ctx] & ~claimed;
+	uint32_t best_prio = threshold[ctx];
+	int irq, best = 0;
+
+	for (irq = 1; irq < PLIC_NR_IRQS; irq++) {
+		if (!(ready & (1U << irq)))
+			continue;
+		if (priority[irq] > best_prio) {
+			best_prio = priority[irq];
+			best = irq;
+		}
+	}
+
+	return best;
+}
+
+int plic_irq_pending(int ctx)
+{
+	return !!plic_best_irq(ctx);
+}
+
+void plic_set_irq(int irq, int lvl)
+{
+	uint32_t mask = 1U << irq;
+
+	if (lvl) {
+		level |= mask;
+		// The gateway only forwards a new request once the previous one completed
+		if (!(claimed & mask))
+			pending |= mask;
+	} else {
+		level &= ~mask;
+		pending &= ~mask;
+	}
+}
+
+static uint32_t plic_read(void *opaque, uint32_t ofs)
+{
+	int ctx, irq;
+
+	if (ofs < PLIC_PRIORITY + 4 * PLIC_NR_IRQS)
+		return priority[ofs / 4];
+	if (ofs == PLIC_PENDING)
+		return pending;
+
+	if (ofs >= PLIC_ENABLE && ofs < PLIC_ENABLE + PLIC_ENABLE_STRIDE * nr_contexts) {
+		ctx = (ofs - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+		return (ofs % PLIC_ENABLE_STRIDE) ? 0 : enable[ctx];
+	}
+
+	if (ofs < PLIC_THRESHOLD || ofs >= PLIC_THRESHOLD + PLIC_CONTEXT_STRIDE * nr_contexts)
+		return 0;
+	ctx = (ofs - PLIC_THRESHOLD) / PLIC_CONTEXT_STRIDE;
+
+	switch (ofs % PLIC_CONTEXT_STRIDE) {
+	case PLIC_THRESHOLD % PLIC_CONTEXT_STRIDE:
+		return threshold[ctx];
+	case PLIC_CLAIM % PLIC_CONTEXT_STRIDE:
+		irq = plic_best_irq(ctx);
+		if (irq) {
+			pending &= ~(1U << irq);
+			claimed |= 1U << irq;
+		}
+		return irq;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t plic_write(void *opaque, uint32_t ofs, uint32_t val)
+{
+	uint32_t mask;
+	int ctx;
+
+	if (ofs < PLIC_PRIORITY + 4 * PLIC_NR_IRQS) {
+		if (ofs)
+			priority[ofs / 4] = val & 7;
+		return 0;
+	}
+
+	if (ofs >= PLIC_ENABLE && ofs < PLIC_ENABLE + PLIC_ENABLE_STRIDE * nr_contexts) {
+		ctx = (ofs - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+		if (!(ofs % PLIC_ENABLE_STRIDE))
+			enable[ctx] = val & ~1;
+		return 0;
+	}
+
+	if (ofs < PLIC_THRESHOLD || ofs >= PLIC_THRESHOLD + PLIC_CONTEXT_STRIDE * nr_contexts)
+		return 0;
+	ctx = (ofs - PLIC_THRESHOLD) / PLIC_CONTEXT_STRIDE;
+
+	switch (ofs % PLIC_CONTEXT_STRIDE) {
+	case PLIC_THRESHOLD % PLIC_CONTEXT_STRIDE:
+		threshold[ctx] = val & 7;
+		break;
+	case PLIC_CLAIM % PLIC_CONTEXT_STRIDE:
+		if (val == 0 || val >= PLIC_NR_IRQS)
+			break;
+		mask = 1U << val;
+		claimed &= ~mask;
+		// still asserted, forward it again
+		if (level & mask)
+			pending |= mask;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void plic_dt_props(FILE *f, struct mmio_dev *dev)
+{
+	int ctx;
+
+	fprintf(f, "\t\t\tphandle = <0x%02x>;\n", DT_PHANDLE_PLIC);
+	fprintf(f, "\t\t\triscv,ndev = <0x%02x>;\n", PLIC_NR_IRQS - 1);
+	fprintf(f, "\t\t\tinterrupts-extended = <");
+	for (ctx = 0; ctx < nr_contexts; ctx++)
+		fprintf(f, "%s0x%02x 0x0b", ctx ? " " : "", DT_PHANDLE_HART_INTC(ctx));
+	fprintf(f, ">;\n");
+	fprintf(f, "\t\t\tinterrupt-controller;\n");
+	fprintf(f, "\t\t\t#address-cells = <0x00>;\n");
+	fprintf(f, "\t\t\t#interrupt-cells = <0x01>;\n");
+}
+
+static struct mmio_dev plic_dev = {
+	.name = "plic",
+	.compatible = "\"sifive,plic-1.0.0\", \"riscv,plic0\"",
+	.base = PLIC_BASE,
+	.size = PLIC_SIZE,
+	.read = plic_read,
+	.write = plic_write,
+	.dt_props = plic_dt_props,
+};
+
+void plic_init(int nr_harts)
+{
+	nr_contexts = nr_harts < PLIC_MAX_CONTEXTS ? nr_harts : PLIC_MAX_CONTEXTS;
+	mmio_register(&plic_dev);
+}
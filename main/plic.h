@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PLIC_H
+#define PLIC_H
+
+#include <stdint.h>
+
+#define PLIC_BASE		0x10400000
+#define PLIC_SIZE		0x400000
+
+/* interrupt sources, 0 is reserved by the spec */
+#define PLIC_NR_IRQS		32
+#define UART_IRQ		1
+#define VIRTIO_BLK_IRQ		2
+#define VIRTIO_CONSOLE_IRQ	3
+
+/* one M-mode context per hart */
+#define PLIC_MAX_CONTEXTS	8
+
+void plic_init(int nr_harts);
+void plic_set_irq(int irq, int level);
+/* whether context ctx has an interrupt to take */
+int plic_irq_pending(int ctx);
+
+#endif /* PLIC_H */
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -11,70 +12,174 @@
 #include "freertos/task.h"
 #include "esp_attr.h"
 #include "esp_flash.h"
+#include "esp_intr_alloc.h"
+#include "esp_partition.h"
 #include "esp_timer.h"
+#include "hal/gpio_ll.h"
 #include "hal/usb_serial_jtag_ll.h"
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
+#include "soc/periph_defs.h"
+#include "cache.h"
 #include "psram.h"
+#include "uart.h"
+#include "zram.h"
+
+/* the emulator task, notified by the USB serial ISR when input arrives */
+static TaskHandle_t emu_task;
 
 uint64_t GetTimeMicroseconds()
 {
 	return esp_timer_get_time();
 }
 
-int ReadKBByte(void)
+void WaitForEvent(uint64_t timeout_us)
 {
-	uint8_t rxchar;
-	int rread;
+	TickType_t ticks = timeout_us / (portTICK_PERIOD_MS * 1000);
 
-	rread = usb_serial_jtag_ll_read_rxfifo(&rxchar, 1);
+	// shorter than a tick, not worth a context switch
+	if (!ticks) {
+		usleep(timeout_us);
+		return;
+	}
+	ulTaskNotifyTake(pdTRUE, ticks);
+}
 
-	if (rread > 0)
-		return rxchar;
-	else
-		return -1;
+// only called from the USB serial ISR
+static void SignalEvent(void)
+{
+	BaseType_t woken = pdFALSE;
+
+	vTaskNotifyGiveFromISR(emu_task, &woken);
+	if (woken)
+		portYIELD_FROM_ISR();
+}
+
+static void usb_serial_rx_isr(void *arg)
+{
+	struct uart_rx *rx = arg;
+	uint8_t rxbuf[64];
+	int i, rread;
+
+	if (!(usb_serial_jtag_ll_get_intsts_mask() & USB_SERIAL_JTAG_INTR_SERIAL_OUT_RECV_PKT))
+		return;
+
+	usb_serial_jtag_ll_clr_intsts_mask(USB_SERIAL_JTAG_INTR_SERIAL_OUT_RECV_PKT);
+	while (usb_serial_jtag_ll_rxfifo_data_available()) {
+		rread = usb_serial_jtag_ll_read_rxfifo(rxbuf, sizeof(rxbuf));
+		for (i = 0; i < rread; i++)
+			uart_rx_push(rx, rxbuf[i]);
+	}
+	SignalEvent();
 }
 
-int IsKBHit(void)
+int StartKBReader(void)
 {
-	return usb_serial_jtag_ll_rxfifo_data_available();
+	esp_err_t ret;
+
+	emu_task = xTaskGetCurrentTaskHandle();
+	usb_serial_jtag_ll_clr_intsts_mask(USB_SERIAL_JTAG_INTR_SERIAL_OUT_RECV_PKT);
+	usb_serial_jtag_ll_ena_intr_mask(USB_SERIAL_JTAG_INTR_SERIAL_OUT_RECV_PKT);
+	ret = esp_intr_alloc(ETS_USB_SERIAL_JTAG_INTR_SOURCE, 0, usb_serial_rx_isr,
+			     uart_rx_ring(), NULL);
+	if (ret != ESP_OK)
+		return -1;
+
+	return 0;
 }
 
 #define GPIO_MOSI	7
 #define GPIO_MISO	2
+#define GPIO_WP		5
+#define GPIO_HD		4
 #define GPIO_CS		10
 #define GPIO_SCLK	6
 #define SPI_HOST_ID	1
 #define SPI_FREQ	80000000; // 80MHz
 
-#define CMD_WRITE	0x02
-#define CMD_READ	0x03
-#define CMD_FAST_READ	0x0b
-#define CMD_RESET_EN	0x66
-#define CMD_RESET	0x99
-#define CMD_READ_ID	0x9f
+/*
+ * Command set used for the data transfers. PSRAM_QPI moves 4 bits per
+ * clock, but needs WP and HD wired to the chips too. A wrapped burst stays
+ * within 32 bytes, so a cache line takes two transactions then.
+ */
+#define PSRAM_MODE	PSRAM_SPI
+#define PSRAM_WRAP	0
+
+/*
+ * Chips on the bus, a power of two. They share SPI2 and only have a CS
+ * each, so more chips add capacity but not bandwidth: the transactions
+ * still go out one at a time. Guest RAM is striped over them in units of
+ * PSRAM_UNIT bytes, see psram_stripe().
+ */
+#define PSRAM_CHIPS	1
+#define PSRAM_UNIT	64
+
+// read by the CS callbacks, which may run with the flash cache disabled
+static DRAM_ATTR const int gpio_cs[PSRAM_CHIPS] = { GPIO_CS };
 
 static spi_device_handle_t handle;
+static const struct psram_xport *xport = &psram_xports[PSRAM_SPI];
+
+/*
+ * The transactions in flight, used round robin. A request may take more
+ * than one, trans_req[] points to it from its last one only.
+ */
+static spi_transaction_ext_t trans[PSRAM_QUEUE_DEPTH];
+static struct psram_req *trans_req[PSRAM_QUEUE_DEPTH];
+static int trans_next, inflight;
 
-static esp_err_t psram_send_cmd(spi_device_handle_t h, const uint8_t cmd)
+/*
+ * CS is a plain GPIO, driven from the SPI driver around every transaction,
+ * the chip is in t->user. The ll call is inline, so this is safe while
+ * esp_flash_read() has the flash cache disabled.
+ */
+static void IRAM_ATTR psram_cs_low(spi_transaction_t *t)
+{
+	gpio_ll_set_level(&GPIO, gpio_cs[(intptr_t)t->user], 0);
+}
+
+static void IRAM_ATTR psram_cs_high(spi_transaction_t *t)
+{
+	gpio_ll_set_level(&GPIO, gpio_cs[(intptr_t)t->user], 1);
+}
+
+/* spi_master flags for the phases x puts on four lines */
+static uint32_t psram_trans_flags(const struct psram_xport *x)
+{
+	uint32_t flags = 0;
+
+	if (x->cmd_lines == 4)
+		flags |= SPI_TRANS_MULTILINE_CMD;
+	if (x->addr_lines == 4)
+		flags |= SPI_TRANS_MULTILINE_ADDR;
+	if (x->data_lines == 4)
+		flags |= SPI_TRANS_MODE_QIO;
+	return flags;
+}
+
+static esp_err_t psram_send_cmd(spi_device_handle_t h, int chip, const struct psram_xport *x,
+				const uint8_t cmd)
 {
 	spi_transaction_ext_t t = { };
-	t.base.flags = SPI_TRANS_VARIABLE_ADDR;
+	t.base.flags = SPI_TRANS_VARIABLE_ADDR | psram_trans_flags(x);
 	t.base.cmd = cmd;
 	t.base.length = 0;
+	t.base.user = (void *)(intptr_t)chip;
         t.command_bits = 8U;
         t.address_bits = 0;
 
 	return spi_device_polling_transmit(h, (spi_transaction_t*)&t);
 }
 
-static esp_err_t psram_read_id(spi_device_handle_t h, uint8_t *rxdata)
+// only works in SPI mode
+static esp_err_t psram_read_id(spi_device_handle_t h, int chip, uint8_t *rxdata)
 {
 	spi_transaction_t t = { };
-	t.cmd = CMD_READ_ID;
+	t.cmd = PSRAM_CMD_READ_ID;
 	t.addr = 0;
 	t.rx_buffer = rxdata;
 	t.length = 6 * 8;
+	t.user = (void *)(intptr_t)chip;
 	return spi_device_polling_transmit(h, &t);
 }
 
@@ -82,19 +187,22 @@ int psram_init(void)
 {
 	esp_err_t ret;
 	uint8_t id[6];
+	int i;
 
-	gpio_reset_pin(GPIO_CS);
-	gpio_set_direction(GPIO_CS, GPIO_MODE_OUTPUT);
-	gpio_set_level(GPIO_CS, 1);
+	for (i = 0; i < PSRAM_CHIPS; i++) {
+		gpio_reset_pin(gpio_cs[i]);
+		gpio_set_direction(gpio_cs[i], GPIO_MODE_OUTPUT);
+		gpio_set_level(gpio_cs[i], 1);
+	}
 
 	spi_bus_config_t spi_bus_config = {
 		.mosi_io_num = GPIO_MOSI,
 		.miso_io_num = GPIO_MISO,
 		.sclk_io_num = GPIO_SCLK,
-		.quadwp_io_num = -1,
-		.quadhd_io_num = -1,
+		.quadwp_io_num = PSRAM_MODE == PSRAM_QPI ? GPIO_WP : -1,
+		.quadhd_io_num = PSRAM_MODE == PSRAM_QPI ? GPIO_HD : -1,
 		.max_transfer_sz = 0,
-		.flags = 0,
+		.flags = PSRAM_MODE == PSRAM_QPI ? SPICOMMON_BUSFLAG_QUAD : 0,
 	};
 
 	printf("SPI_HOST_ID = %d\n", SPI_HOST_ID);
@@ -107,88 +215,243 @@ int psram_init(void)
 	memset(&devcfg, 0, sizeof(spi_device_interface_config_t));
 	devcfg.clock_speed_hz = SPI_FREQ;
 	devcfg.spics_io_num = -1;
-	devcfg.queue_size = 1;
+	devcfg.queue_size = PSRAM_QUEUE_DEPTH;
 	devcfg.command_bits = 8;
 	devcfg.address_bits = 24;
+	// the multi line modes are half duplex only
+	devcfg.flags = SPI_DEVICE_HALFDUPLEX;
+	devcfg.pre_cb = psram_cs_low;
+	devcfg.post_cb = psram_cs_high;
 
 	ret = spi_bus_add_device(SPI_HOST_ID, &devcfg, &handle);
 	printf("spi_bus_add_device = %d\n", ret);
 	if (ret != ESP_OK)
 		return -1;
 
-	gpio_set_level(GPIO_CS, 1);
 	usleep(200);
 
-	gpio_set_level(GPIO_CS, 0);
-	psram_send_cmd(handle, CMD_RESET_EN);
-	psram_send_cmd(handle, CMD_RESET);
-	gpio_set_level(GPIO_CS, 1);
+	for (i = 0; i < PSRAM_CHIPS; i++) {
+		// a chip left in QPI by a soft reset would not understand a SPI reset
+		if (PSRAM_MODE == PSRAM_QPI)
+			psram_send_cmd(handle, i, &psram_xports[PSRAM_QPI], PSRAM_CMD_EXIT_QPI);
+		psram_send_cmd(handle, i, xport, PSRAM_CMD_RESET_EN);
+		psram_send_cmd(handle, i, xport, PSRAM_CMD_RESET);
+	}
 	usleep(200);
 
-	gpio_set_level(GPIO_CS, 0);
-	ret = psram_read_id(handle, id);
-	gpio_set_level(GPIO_CS, 1);
-	if (ret != ESP_OK)
-		return -1;
+	for (i = 0; i < PSRAM_CHIPS; i++) {
+		ret = psram_read_id(handle, i, id);
+		if (ret != ESP_OK)
+			return -1;
+		printf("PSRAM%d ID: %02x%02x%02x%02x%02x%02x\n", i, id[0], id[1], id[2], id[3], id[4], id[5]);
+	}
+
+	for (i = 0; i < PSRAM_CHIPS; i++) {
+		if (PSRAM_MODE == PSRAM_QPI)
+			psram_send_cmd(handle, i, xport, PSRAM_CMD_ENTER_QPI);
+		// bursts are linear after reset
+		if (PSRAM_WRAP)
+			psram_send_cmd(handle, i, &psram_xports[PSRAM_MODE], PSRAM_CMD_WRAP_TOGGLE);
+	}
+	xport = &psram_xports[PSRAM_MODE];
+	printf("PSRAM: %s, %s bursts\n", xport->name, PSRAM_WRAP ? "wrapped" : "linear");
 
-	printf("PSRAM ID: %02x%02x%02x%02x%02x%02x\n", id[0], id[1], id[2], id[3], id[4], id[5]);
 	return 0;
 }
 
-int psram_read(uint32_t addr, void *buf, int len)
+/* Size of the piece of a transfer at addr that one transaction can move */
+static int psram_piece(uint32_t addr, int len)
 {
-	esp_err_t ret;
-	spi_transaction_ext_t t = { };
+	int n = PSRAM_UNIT - addr % PSRAM_UNIT;
 
-	t.base.cmd = CMD_FAST_READ;
-	t.base.addr = addr;
-	t.base.rx_buffer = buf;
-	t.base.length = len * 8;
-	t.base.flags = SPI_TRANS_VARIABLE_DUMMY;
-	t.dummy_bits = 8;
+	// the chip address is the same modulo PSRAM_UNIT, and so modulo the burst
+	if (n > psram_burst(addr, PSRAM_WRAP))
+		n = psram_burst(addr, PSRAM_WRAP);
+	return n < len ? n : len;
+}
 
-	gpio_set_level(GPIO_CS, 0);
-	ret = spi_device_polling_transmit(handle, (spi_transaction_t*)&t);
-	gpio_set_level(GPIO_CS, 1);
+static void psram_trans(spi_transaction_ext_t *t, uint32_t addr, void *buf, int len, int write)
+{
+	uint32_t chipaddr;
+	int chip;
+
+	chip = psram_stripe(addr, PSRAM_CHIPS, PSRAM_UNIT, &chipaddr);
+	memset(t, 0, sizeof(*t));
+	t->base.addr = chipaddr;
+	t->base.length = len * 8;
+	t->base.user = (void *)(intptr_t)chip;
+	t->base.flags = psram_trans_flags(xport);
+	if (write) {
+		t->base.cmd = xport->write;
+		t->base.tx_buffer = buf;
+	} else {
+		t->base.cmd = xport->read;
+		t->base.rx_buffer = buf;
+		t->base.rxlength = len * 8;
+		t->base.flags |= SPI_TRANS_VARIABLE_DUMMY;
+		t->dummy_bits = xport->read_wait;
+	}
+}
 
-	if (ret != ESP_OK) {
-		printf("psram_read failed %lx %d\n", addr, len);
-		return -1;
+/* Take the oldest transaction in flight back, waiting up to ticks for it */
+static int psram_complete(TickType_t ticks)
+{
+	spi_transaction_t *t;
+	struct psram_req *req;
+
+	if (!inflight || spi_device_get_trans_result(handle, &t, ticks) != ESP_OK)
+		return 0;
+
+	inflight--;
+	req = trans_req[(spi_transaction_ext_t *)t - trans];
+	if (req) {
+		req->pending = 0;
+		if (req->done)
+			req->done(req);
 	}
 
-	return len;
+	return 1;
 }
 
-int psram_write(uint32_t addr, void *buf, int len)
+int psram_submit(struct psram_req *req)
 {
-	esp_err_t ret;
-	spi_transaction_t t = {};
+	spi_transaction_ext_t *t;
+	uint32_t addr = req->addr;
+	uint8_t *buf = req->buf;
+	int n, len = req->len;
+
+	req->ret = req->len;
+	req->pending = 1;
+	for (; len; addr += n, buf += n, len -= n) {
+		// the oldest one owns the transaction we are about to reuse
+		if (inflight == PSRAM_QUEUE_DEPTH)
+			psram_complete(portMAX_DELAY);
+
+		n = psram_piece(addr, len);
+		t = &trans[trans_next];
+		psram_trans(t, addr, buf, n, req->write);
+		trans_req[trans_next] = n == len ? req : NULL;
+		if (spi_device_queue_trans(handle, (spi_transaction_t *)t, portMAX_DELAY) != ESP_OK) {
+			printf("psram_submit failed %lx %d\n", addr, n);
+			// the pieces already queued still point into buf
+			psram_sync();
+			req->ret = -1;
+			req->pending = 0;
+			return -1;
+		}
+		trans_next = (trans_next + 1) % PSRAM_QUEUE_DEPTH;
+		inflight++;
+	}
 
-	t.cmd = CMD_WRITE;
-	t.addr = addr;
-	t.tx_buffer = buf;
-	t.length = len * 8;
+	return 0;
+}
 
-	gpio_set_level(GPIO_CS, 0);
-	ret = spi_device_polling_transmit(handle, &t);
-	gpio_set_level(GPIO_CS, 1);
+int psram_poll(void)
+{
+	int n = 0;
 
-	if (ret != ESP_OK) {
-		printf("psram_write failed %lx %d\n", addr, len);
-		return -1;
+	while (psram_complete(0))
+		n++;
+	return n;
+}
+
+void psram_wait(struct psram_req *req)
+{
+	while (req->pending)
+		psram_complete(portMAX_DELAY);
+}
+
+// polling transfers can't be mixed with queued ones still in flight
+void psram_sync(void)
+{
+	while (inflight)
+		psram_complete(portMAX_DELAY);
+}
+
+int psram_read(uint32_t addr, void *buf, int len)
+{
+	esp_err_t ret;
+	spi_transaction_ext_t t;
+	uint8_t *p = buf;
+	int n, left = len;
+
+	psram_sync();
+	for (; left; addr += n, p += n, left -= n) {
+		n = psram_piece(addr, left);
+		psram_trans(&t, addr, p, n, 0);
+		ret = spi_device_polling_transmit(handle, (spi_transaction_t*)&t);
+		if (ret != ESP_OK) {
+			printf("psram_read failed %lx %d\n", addr, n);
+			return -1;
+		}
+	}
+
+	return len;
+}
+
+int psram_write(uint32_t addr, void *buf, int len)
+{
+	esp_err_t ret;
+	spi_transaction_ext_t t;
+	uint8_t *p = buf;
+	int n, left = len;
+
+	psram_sync();
+	for (; left; addr += n, p += n, left -= n) {
+		n = psram_piece(addr, left);
+		psram_trans(&t, addr, p, n, 1);
+		ret = spi_device_polling_transmit(handle, (spi_transaction_t*)&t);
+		if (ret != ESP_OK) {
+			printf("psram_write failed %lx %d\n", addr, n);
+			return -1;
+		}
 	}
 
 	return len;
 }
 
+// PSRAM is behind SPI
+void *psram_map(void)
+{
+	return NULL;
+}
+
 #define kernel_start	0x200000
 #define kernel_end	0x363b8c
 
-static char dmabuf[64];
+/* the flash read of one chunk overlaps with the PSRAM writes of the others */
+static char dmabuf[PSRAM_QUEUE_DEPTH][64];
+static struct psram_req loadreq[PSRAM_QUEUE_DEPTH];
+
+/*
+ * The kernel partition mapped through the flash MMU, which has a cache of
+ * its own. The guest reads the kernel from there until it writes a page,
+ * see cache_rom(), so only the last partial line is copied to PSRAM.
+ */
+static const void *kernel_map;
+static esp_partition_mmap_handle_t kernel_map_handle;
+
+static const void *MapKernel(long flen)
+{
+	const esp_partition_t *part;
+
+	if (kernel_map)
+		return kernel_map;
+
+	part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "kernel");
+	if (!part || part->address != kernel_start ||
+	    esp_partition_mmap(part, 0, flen, ESP_PARTITION_MMAP_DATA, &kernel_map, &kernel_map_handle) != ESP_OK) {
+		printf("failed to map the kernel, copying it to psram\n");
+		kernel_map = NULL;
+	}
+	return kernel_map;
+}
+
 int load_images(int ram_size, int *kern_len)
 {
 	long flen;
 	uint32_t addr, flashaddr;
+	int i, n;
 
 	flen = kernel_end - kernel_start;
 	if (flen > ram_size) {
@@ -199,21 +462,68 @@ int load_images(int ram_size, int *kern_len)
 		*kern_len = flen;
 
 	addr = 0;
-	flashaddr = kernel_start;
-	printf("loading kernel Image (%ld bytes) from flash:%lx into psram:%lx\n", flen, flashaddr, addr);
-	while (flen >= 64) {
-		esp_flash_read(NULL, dmabuf, flashaddr, 64);
-		psram_write(handle, addr, dmabuf, 64);
-		addr += 64;
-		flashaddr += 64;
-		flen -= 64;
+	if (MapKernel(flen) && cache_rom(kernel_map, flen) == 0) {
+		printf("kernel Image (%ld bytes) mapped from flash:%x\n", flen, kernel_start);
+		addr = flen & ~0x3f;
+		flen &= 0x3f;
+	} else {
+		cache_rom(NULL, 0);
 	}
-	if (flen) {
-		esp_flash_read(NULL, dmabuf, flashaddr, flen);
-		psram_write(handle, addr, dmabuf, flen);
+	if (zram_budget && zram_load(ram_size, NULL, 0) < 0)
+		return -1;
+	flashaddr = kernel_start + addr;
+	printf("loading kernel Image (%ld bytes) from flash:%lx into %s:%lx\n", flen, flashaddr,
+	       zram_budget ? "zram" : "psram", addr);
+	for (i = 0; flen > 0; i = (i + 1) % PSRAM_QUEUE_DEPTH) {
+		n = flen < 64 ? flen : 64;
+		// the buffer is free once its previous write is done
+		psram_wait(&loadreq[i]);
+		esp_flash_read(NULL, dmabuf[i], flashaddr, n);
+		if (zram_budget) {
+			zram_write(addr, dmabuf[i], n);
+		} else {
+			loadreq[i].addr = addr;
+			loadreq[i].buf = dmabuf[i];
+			loadreq[i].len = n;
+			loadreq[i].write = 1;
+			if (psram_submit(&loadreq[i]) < 0)
+				return -1;
+		}
+		addr += n;
+		flashaddr += n;
+		flen -= n;
 	}
+	psram_sync();
 
-	return 0;
+	return zram_failed ? -1 : 0;
+}
+
+/*
+ * The rootfs partition is served read only, rewriting it would need a
+ * sector erase for every 512 byte write.
+ */
+static const esp_partition_t *rootfs;
+
+int blkdev_init(uint64_t *nr_sectors)
+{
+	rootfs = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "rootfs");
+	if (!rootfs)
+		return -1;
+
+	*nr_sectors = rootfs->size / 512;
+	return 1;
+}
+
+int blkdev_read(uint64_t sector, void *buf, int count)
+{
+	if (esp_partition_read(rootfs, sector * 512, buf, count * 512) != ESP_OK)
+		return -1;
+	return count;
+}
+
+int blkdev_write(uint64_t sector, void *buf, int count)
+{
+	return -1;
 }
 
 #if 0
@@ -1,21 +1,148 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/time.h>
-#include <sys/ioctl.h>
 
-extern struct MiniRV32IMAState core;
+#include "cache.h"
+#include "costmodel.h"
+#include "fusion.h"
+#include "port.h"
+#include "profile.h"
+#include "psram.h"
+#include "smp.h"
+#include "trace.h"
+#include "uart.h"
+#include "zram.h"
+
+extern __vm struct MiniRV32IMAState core;
 extern void DumpState(struct MiniRV32IMAState *core);
 extern void app_main(void);
+extern int dump_dt;
+extern int idle_fastforward;
+extern volatile int poweroff_req;
+extern uint32_t icount_ratio;
 extern char kernel_start[], kernel_end[];
 
-static int ramfd;
-static int is_eofd;
+/* guest RAM, a private mapping of imagefd */
+static __vm uint8_t *ram;
+static __vm uint32_t ram_len;
+static __vm int blkfd = -1;
+static const char *blkdev_path;
+static const char *trace_path;
+/* self pipe, the KB reader writes a byte to it to wake up WaitForEvent() */
+static __vm int eventfd[2] = { -1, -1 };
+/*
+ * Self pipes of the secondary harts, kept across reboots so that a late
+ * KickHart() never hits a reused fd. Hart 0 uses eventfd above.
+ */
+static int hart_pipe[SMP_MAX_HARTS][2];
+
+/*
+ * The kernel image followed by zeroes up to the RAM size. Every VM maps it
+ * MAP_PRIVATE, so the kernel pages are shared until a guest writes them.
+ */
+static int imagefd = -1;
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the kernel mapped read only, what flash is to the MCU ports, see cache_rom() */
+static const uint8_t *kernel_rom;
+/* -R: read the kernel from RAM only, as it was copied there */
+static int kernel_copy;
+
+/*
+ * PSRAM64H protocol simulator, one per chip. Transfers reach it framed as
+ * on the wire: a command, for most of them a 24 bit address, wait clocks,
+ * then data, each phase on the lines the command set uses. Framing the
+ * chip would not understand in its current mode counts as an error and
+ * moves no data, like a real chip would return garbage.
+ */
+struct psram_chip {
+	int qpi, wrap, reset_en;
+	uint64_t clocks, errors;
+	/* data transfers, by direction */
+	struct cost_psram stat;
+};
+
+struct psram_frame {
+	const struct psram_xport *x;
+	uint8_t cmd;
+	uint32_t addr;
+	int wait;
+	uint8_t *data;
+	int len;
+};
+
+/*
+ * PSRAM requests are run by an I/O thread, one per VM. The queue runs from
+ * head to tail in submission order, next is the first one not run yet.
+ * Only the VM thread adds and removes entries. Waking the I/O thread for
+ * every request costs more than the copy, so it is only kicked between
+ * slices, and the VM thread runs the requests itself when it has to wait.
+ */
+struct psram_io {
+	pthread_mutex_t lock;
+	/* work: kicked I/O thread, done: a request finished */
+	pthread_cond_t work, done;
+	pthread_t tid;
+	struct psram_req *head, *tail, *next;
+	int queued;
+	/* one of the threads is running next */
+	int busy;
+	/* kick the I/O thread at all, not worth it with a single host CPU */
+	int kick;
+	/* backing store of each chip, see load_images() */
+	uint8_t *mem[PSRAM_MAX_CHIPS];
+	struct psram_chip chip[PSRAM_MAX_CHIPS];
+	uint32_t ram_len;
+	int stop;
+};
+static __vm struct psram_io io;
+
+/* -c: guest RAM striped over nr_chips simulated chips in stripe_unit bytes */
+static int nr_chips = 1;
+static uint32_t stripe_unit = 64;
+/* -p: command set and burst mode of the chips */
+static const struct psram_xport *xport = &psram_xports[PSRAM_SPI];
+static int psram_wrap;
+
+// SPI at 80MHz
+#define SPI_CLK_PS		12500
+// CS and driver overhead around each transaction
+#define SPI_SETUP_NS		1000
+
+/*
+ * Timing model of the chips, each one on its own bus. model_ns is the time
+ * the emulator spent waiting for them, guest execution is not modelled.
+ * The end times of the requests in flight are kept in queue order.
+ */
+static __vm uint64_t model_ns;
+static __vm uint64_t chip_busy[PSRAM_MAX_CHIPS], chip_xfers[PSRAM_MAX_CHIPS], chip_ns[PSRAM_MAX_CHIPS];
+static __vm uint64_t model_end[PSRAM_QUEUE_DEPTH];
+static __vm int model_head;
+
+static void PsramReport(FILE *f);
+static void PsramStat(struct cost_psram *ps);
+
+/* -n: number of VMs to run, -j: how many of them at the same time */
+static int nr_vms = 1, nr_jobs;
+static int vms_running;
+static pthread_mutex_t vm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vm_exited = PTHREAD_COND_INITIALIZER;
+
+struct kbreader {
+	struct uart_rx *rx;
+	int eventfd;
+};
 
 static void ResetKeyboardInput(void)
 {
@@ -28,11 +155,20 @@ static void ResetKeyboardInput(void)
 
 static void CtrlC(int sig)
 {
-	DumpState(&core);
+	if (nr_vms == 1) {
+		DumpState(&core);
+		PsramReport(stdout);
+	}
 	ResetKeyboardInput();
 	exit(0);
 }
 
+// Ask hart 0 to write the trace ring out, it does so between slices
+static void TraceSignal(int sig)
+{
+	trace_dump_req = 1;
+}
+
 // Override keyboard, so we can capture all keyboard input for the VM.
 static void CaptureKeyboardInput(void)
 {
@@ -40,6 +176,7 @@ static void CaptureKeyboardInput(void)
 
 	// Hook exit, because we want to re-enable keyboard.
 	signal(SIGINT, CtrlC);
+	signal(SIGUSR1, TraceSignal);
 
 	tcgetattr(0, &term);
 	term.c_lflag &= ~(ICANON | ECHO); // Disable echo as well
@@ -53,64 +190,919 @@ uint64_t GetTimeMicroseconds()
 	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
 }
 
-int ReadKBByte(void)
+static void SignalEvent(int fd)
+{
+	char c = 0;
+
+	// a full pipe already has a wakeup pending
+	write(fd, &c, 1);
+}
+
+static int EventPipe(int fds[2])
 {
-	char rxchar;
-	int rread;
+	if (pipe(fds) < 0)
+		return -1;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+static void *KBReader(void *arg)
+{
+	struct kbreader *kb = arg;
+	char rxbuf[64];
+	int i, rread;
 
-	if (is_eofd)
-		return 0xffffffff;
+	for (;;) {
+		rread = read(0, rxbuf, sizeof(rxbuf));
+		if (rread <= 0)
+			break;
+		for (i = 0; i < rread; i++)
+			uart_rx_push(kb->rx, rxbuf[i]);
+		SignalEvent(kb->eventfd);
+	}
+	uart_rx_eof(kb->rx);
+	SignalEvent(kb->eventfd);
 
-	rread = read(0, &rxchar, 1);
+	return NULL;
+}
 
-	if (rread > 0) // Tricky: getchar can't be used with arrow keys.
-		return rxchar;
-	else
+void WaitForEvent(uint64_t timeout_us)
+{
+	struct pollfd pfd = { .fd = eventfd[0], .events = POLLIN };
+	char buf[64];
+
+	// round up, waking up before the deadline only costs another loop
+	if (poll(&pfd, 1, (timeout_us + 999) / 1000) > 0)
+		while (read(eventfd[0], buf, sizeof(buf)) > 0)
+			;
+}
+
+/*
+ * -x script: benchmark mode, the script replaces the keyboard. Its lines:
+ *   phase name	start a new phase, at the last expect matched
+ *   send text	type text, with \n, \r, \t and \\ escapes
+ *   expect text	wait until the guest printed text
+ *   timeout secs	time allowed to every following expect, default 300
+ * The VM thread matches the console output in ConsoleWrite() and takes a
+ * snapshot of its counters there, the script thread only sees those. At
+ * the end of the script the machine is powered off, so the usual reports
+ * are printed before the results are written.
+ */
+#define BENCH_MAX_PHASES	32
+#define BENCH_MAX_PATTERN	255
+
+struct bench_stat {
+	uint64_t us, insns, hits, accesses, xfers, read_bytes, write_bytes;
+};
+
+struct bench_phase {
+	char name[32];
+	struct bench_stat start, end;
+};
+
+static struct {
+	const char *script, *out;
+	pthread_mutex_t lock;
+	pthread_cond_t matched;
+	/* pattern waited for, cleared by the VM thread when it shows up */
+	const char *pattern;
+	char seen[2 * BENCH_MAX_PATTERN + 1];
+	int seen_len;
+	/* counters at the last match, and at the last console write */
+	struct bench_stat mark, last;
+	struct bench_phase phases[BENCH_MAX_PHASES];
+	int nr_phases;
+	struct uart_rx *rx;
+	int eventfd;
+	/* set once the script is over, error is empty if it went through */
+	int done;
+	// the longest message with a whole line in it, the line number included
+	char error[BENCH_MAX_PATTERN + 16 + 48];
+} bench = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.matched = PTHREAD_COND_INITIALIZER,
+};
+
+static void BenchStat(struct bench_stat *s)
+{
+	struct cost_psram ps;
+
+	s->us = GetTimeMicroseconds();
+	s->insns = cost_insn_count();
+	cache_get_stat(&s->hits, &s->accesses);
+	PsramStat(&ps);
+	s->xfers = ps.xfers[0] + ps.xfers[1];
+	s->read_bytes = ps.payload[0];
+	s->write_bytes = ps.payload[1];
+}
+
+/*
+ * Look for the pattern waited for in what the guest printed, with
+ * bench.lock held. The counters of the match are those of the console
+ * write that completed it, the only place they can be taken.
+ */
+static int BenchMatch(void)
+{
+	char *p;
+
+	if (!bench.pattern)
+		return 0;
+	p = strstr(bench.seen, bench.pattern);
+	if (!p)
+		return 0;
+
+	// what was matched can't match the next expect
+	p += strlen(bench.pattern);
+	bench.seen_len -= p - bench.seen;
+	memmove(bench.seen, p, bench.seen_len + 1);
+	bench.pattern = NULL;
+	bench.mark = bench.last;
+	return 1;
+}
+
+/* The guest console in benchmark mode, runs on the VM thread */
+static void ConsoleTap(const char *buf, size_t size)
+{
+	size_t n;
+
+	fwrite(buf, 1, size, stdout);
+	fflush(stdout);
+
+	pthread_mutex_lock(&bench.lock);
+	BenchStat(&bench.last);
+	while (size) {
+		// keep the tail, a match may straddle two writes
+		if (bench.seen_len > BENCH_MAX_PATTERN) {
+			memmove(bench.seen, bench.seen + bench.seen_len - BENCH_MAX_PATTERN,
+				BENCH_MAX_PATTERN);
+			bench.seen_len = BENCH_MAX_PATTERN;
+		}
+		n = sizeof(bench.seen) - 1 - bench.seen_len;
+		if (n > size)
+			n = size;
+		memcpy(bench.seen + bench.seen_len, buf, n);
+		bench.seen_len += n;
+		bench.seen[bench.seen_len] = 0;
+		buf += n;
+		size -= n;
+
+		if (BenchMatch())
+			pthread_cond_signal(&bench.matched);
+	}
+	pthread_mutex_unlock(&bench.lock);
+}
+
+#ifdef __APPLE__
+static int ConsoleWrite(void *cookie, const char *buf, int size)
+{
+	ConsoleTap(buf, size);
+	return size;
+}
+#else
+static ssize_t ConsoleWrite(void *cookie, const char *buf, size_t size)
+{
+	ConsoleTap(buf, size);
+	return size;
+}
+#endif
+
+static FILE *OpenConsole(void)
+{
+	FILE *f;
+
+#ifdef __APPLE__
+	f = funopen(NULL, NULL, ConsoleWrite, NULL, NULL);
+#else
+	cookie_io_functions_t io = { .write = ConsoleWrite };
+
+	f = fopencookie(NULL, "w", io);
+#endif
+	if (f)
+		setvbuf(f, NULL, _IONBF, 0);
+	return f;
+}
+
+static void JsonString(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* Write the results out once the machine is down, returns the exit code */
+static int BenchWrite(void)
+{
+	const char *error;
+	struct bench_phase *p;
+	FILE *f;
+	int i;
+
+	pthread_mutex_lock(&bench.lock);
+	if (!bench.done)
+		snprintf(bench.error, sizeof(bench.error), "the guest stopped before the end of the script");
+	error = bench.error[0] ? bench.error : NULL;
+
+	f = fopen(bench.out, "w");
+	if (!f) {
+		perror(bench.out);
+		pthread_mutex_unlock(&bench.lock);
+		return 1;
+	}
+
+	fprintf(f, "{\n\t\"script\": ");
+	JsonString(f, bench.script);
+	if (error) {
+		fprintf(f, ",\n\t\"error\": ");
+		JsonString(f, error);
+	}
+	fprintf(f, ",\n\t\"phases\": [");
+	for (i = 0; i < bench.nr_phases; i++) {
+		p = &bench.phases[i];
+		fprintf(f, "%s\n\t\t{ \"name\": ", i ? "," : "");
+		JsonString(f, p->name);
+		fprintf(f, ", \"wall_us\": %"PRIu64", \"insns\": %"PRIu64
+			", \"cache_hits\": %"PRIu64", \"cache_accesses\": %"PRIu64
+			", \"psram_xfers\": %"PRIu64", \"psram_read_bytes\": %"PRIu64
+			", \"psram_write_bytes\": %"PRIu64" }",
+			p->end.us - p->start.us, p->end.insns - p->start.insns,
+			p->end.hits - p->start.hits, p->end.accesses - p->start.accesses,
+			p->end.xfers - p->start.xfers, p->end.read_bytes - p->start.read_bytes,
+			p->end.write_bytes - p->start.write_bytes);
+	}
+	fprintf(f, "\n\t]\n}\n");
+	fclose(f);
+	pthread_mutex_unlock(&bench.lock);
+
+	if (error)
+		fprintf(stderr, "\nbenchmark failed: %s\n", error);
+	return error ? 1 : 0;
+}
+
+/* Type s, waiting for the guest to make room */
+static void BenchSend(const char *s)
+{
+	char c;
+
+	while ((c = *s++)) {
+		if (c == '\\' && *s) {
+			c = *s++;
+			if (c == 'n')
+				c = '\n';
+			else if (c == 'r')
+				c = '\r';
+			else if (c == 't')
+				c = '\t';
+		}
+		while (!uart_rx_room(bench.rx)) {
+			SignalEvent(bench.eventfd);
+			usleep(1000);
+		}
+		uart_rx_push(bench.rx, c);
+	}
+	SignalEvent(bench.eventfd);
+}
+
+static int BenchExpect(const char *pattern, int timeout)
+{
+	struct timespec ts;
+	int ret = 0, matched;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout;
+
+	pthread_mutex_lock(&bench.lock);
+	bench.pattern = pattern;
+	// the guest may have printed it before the script got here
+	BenchMatch();
+	while (bench.pattern && !ret)
+		ret = pthread_cond_timedwait(&bench.matched, &bench.lock, &ts);
+	matched = !bench.pattern;
+	bench.pattern = NULL;
+	pthread_mutex_unlock(&bench.lock);
+
+	return matched ? 0 : -1;
+}
+
+static void BenchPhase(const char *name)
+{
+	struct bench_phase *p;
+
+	pthread_mutex_lock(&bench.lock);
+	if (bench.nr_phases)
+		bench.phases[bench.nr_phases - 1].end = bench.mark;
+	if (name && bench.nr_phases < BENCH_MAX_PHASES) {
+		p = &bench.phases[bench.nr_phases++];
+		snprintf(p->name, sizeof(p->name), "%s", name);
+		p->start = bench.mark;
+	}
+	pthread_mutex_unlock(&bench.lock);
+}
+
+/* The script is over, power the machine off, hart 0 does so between slices */
+static void BenchEnd(const char *error)
+{
+	BenchPhase(NULL);
+	pthread_mutex_lock(&bench.lock);
+	if (error)
+		snprintf(bench.error, sizeof(bench.error), "%s", error);
+	bench.done = 1;
+	pthread_mutex_unlock(&bench.lock);
+
+	poweroff_req = 1;
+	SignalEvent(bench.eventfd);
+}
+
+static void *ScriptRunner(void *arg)
+{
+	char line[BENCH_MAX_PATTERN + 16], *arg2;
+	char error[sizeof(bench.error)];
+	int timeout = 300, n = 0;
+	FILE *f;
+
+	error[0] = 0;
+	f = fopen(bench.script, "r");
+	if (!f) {
+		perror(bench.script);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		line[strcspn(line, "\n")] = 0;
+		if (!line[0] || line[0] == '#')
+			continue;
+		arg2 = strchr(line, ' ');
+		if (arg2)
+			*arg2++ = 0;
+		else
+			arg2 = "";
+
+		if (!strcmp(line, "phase")) {
+			BenchPhase(arg2);
+		} else if (!strcmp(line, "send")) {
+			BenchSend(arg2);
+		} else if (!strcmp(line, "expect") && *arg2) {
+			if (BenchExpect(arg2, timeout) < 0) {
+				snprintf(error, sizeof(error), "line %d: timeout waiting for %s", n, arg2);
+				break;
+			}
+		} else if (!strcmp(line, "timeout") && atoi(arg2) > 0) {
+			timeout = atoi(arg2);
+		} else {
+			snprintf(error, sizeof(error), "line %d: can't parse %s", n, line);
+			break;
+		}
+	}
+	fclose(f);
+
+	BenchEnd(error[0] ? error : NULL);
+	return NULL;
+}
+
+int StartKBReader(void)
+{
+	static struct kbreader kb;
+	pthread_t tid;
+
+	if (EventPipe(eventfd) < 0)
 		return -1;
+	hart_pipe[0][1] = eventfd[1];
+
+	// with several VMs there is no interactive console
+	if (nr_vms > 1)
+		return 0;
+
+	if (bench.script) {
+		bench.rx = uart_rx_ring();
+		bench.eventfd = eventfd[1];
+		if (pthread_create(&tid, NULL, ScriptRunner, NULL))
+			return -1;
+		pthread_detach(tid);
+		return 0;
+	}
+
+	kb.rx = uart_rx_ring();
+	kb.eventfd = eventfd[1];
+	if (pthread_create(&tid, NULL, KBReader, &kb))
+		return -1;
+	pthread_detach(tid);
+
+	return 0;
+}
+
+struct hart_start {
+	void (*fn)(int hart);
+	int hart;
+};
+
+static void *HartThread(void *arg)
+{
+	struct hart_start hs = *(struct hart_start *)arg;
+
+	free(arg);
+	eventfd[0] = hart_pipe[hs.hart][0];
+	eventfd[1] = hart_pipe[hs.hart][1];
+	hs.fn(hs.hart);
+
+	return NULL;
 }
 
-int IsKBHit(void)
+int StartHart(void (*fn)(int hart), int hart)
 {
-	int byteswaiting;
+	struct hart_start *hs;
+	pthread_t tid;
 
-	if (is_eofd)
+	if (!hart_pipe[hart][1] && EventPipe(hart_pipe[hart]) < 0)
 		return -1;
 
-	ioctl(0, FIONREAD, &byteswaiting);
-	// Is end-of-file for
-	if (!byteswaiting && write(0, 0, 0 ) != 0) {
-		is_eofd = 1;
+	hs = malloc(sizeof(*hs));
+	if (!hs)
+		return -1;
+	hs->fn = fn;
+	hs->hart = hart;
+	if (pthread_create(&tid, NULL, HartThread, hs)) {
+		free(hs);
 		return -1;
 	}
-	return !!byteswaiting;
+	pthread_detach(tid);
+
+	return 0;
 }
 
-int psram_init(void)
+void KickHart(int hart)
+{
+	SignalEvent(hart_pipe[hart][1]);
+}
+
+/*
+ * Size of the piece of a transfer at addr that one transaction can move:
+ * it stays on one chip and in one burst. The chip address is the same as
+ * addr modulo the stripe unit, and so modulo the burst.
+ */
+static uint32_t StripePiece(uint32_t addr, int len)
+{
+	uint32_t n = stripe_unit - addr % stripe_unit;
+
+	if (n > psram_burst(addr, psram_wrap))
+		n = psram_burst(addr, psram_wrap);
+	return n < len ? n : len;
+}
+
+/* Run f on chip c, with mem its backing store. Returns 0, or -1 if garbled */
+static int PsramChip(struct psram_chip *c, uint8_t *mem, struct psram_frame *f)
+{
+	static const uint8_t id[] = { 0x0d, 0x5d };
+	const struct psram_xport *x = f->x;
+	uint32_t addr = f->addr, size, n;
+	int write = 0, addr_lines, data_lines, wait = 0;
+	uint8_t *data = f->data;
+	int len = f->len;
+
+	c->clocks += 8 / x->cmd_lines;
+	// the chip only samples the command on the lines of its mode
+	if ((x->cmd_lines == 4) != c->qpi)
+		goto garbled;
+
+	if (f->cmd != PSRAM_CMD_RESET)
+		c->reset_en = f->cmd == PSRAM_CMD_RESET_EN;
+
+	addr_lines = data_lines = c->qpi ? 4 : 1;
+	switch (f->cmd) {
+	case PSRAM_CMD_RESET_EN:
+		return 0;
+	case PSRAM_CMD_RESET:
+		if (c->reset_en)
+			c->qpi = c->wrap = c->reset_en = 0;
+		return 0;
+	case PSRAM_CMD_ENTER_QPI:
+		c->qpi = 1;
+		return 0;
+	case PSRAM_CMD_EXIT_QPI:
+		if (!c->qpi)
+			goto garbled;
+		c->qpi = 0;
+		return 0;
+	case PSRAM_CMD_WRAP_TOGGLE:
+		c->wrap = !c->wrap;
+		return 0;
+	case PSRAM_CMD_READ_ID:
+		if (c->qpi)
+			goto garbled;
+		break;
+	case PSRAM_CMD_READ:
+		if (c->qpi)
+			goto garbled;
+		break;
+	case PSRAM_CMD_FAST_READ:
+		wait = c->qpi ? 4 : 8;
+		break;
+	case PSRAM_CMD_QUAD_READ:
+		addr_lines = data_lines = 4;
+		wait = 6;
+		break;
+	case PSRAM_CMD_WRITE:
+		write = 1;
+		break;
+	case PSRAM_CMD_QUAD_WRITE:
+		addr_lines = data_lines = 4;
+		write = 1;
+		break;
+	default:
+		goto garbled;
+	}
+
+	c->clocks += 24 / x->addr_lines + f->wait + len * 8 / x->data_lines;
+	if (x->addr_lines != addr_lines || f->wait != wait || x->data_lines != data_lines)
+		goto garbled;
+
+	c->stat.xfers[write]++;
+	c->stat.overhead[write] += 4 + wait * data_lines / 8;
+	c->stat.payload[write] += len;
+
+	if (f->cmd == PSRAM_CMD_READ_ID) {
+		memset(data, 0, len);
+		memcpy(data, id, len < sizeof(id) ? len : sizeof(id));
+		return 0;
+	}
+
+	// a burst goes on at the start of its page, or of its 32 bytes if wrapped
+	size = c->wrap ? PSRAM_WRAP_SIZE : PSRAM_PAGE_SIZE;
+	while (len) {
+		n = psram_burst(addr, c->wrap);
+		if (n > len)
+			n = len;
+		if (write)
+			memcpy(mem + addr, data, n);
+		else
+			memcpy(data, mem + addr, n);
+		addr = (addr + n - 1) / size * size;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+
+garbled:
+	c->errors++;
+	return -1;
+}
+
+/* Send a command without address or data to chip i on the lines of x */
+static int PsramCmd(struct psram_io *io, int i, const struct psram_xport *x, uint8_t cmd)
 {
-	ramfd = open("/tmp/ram", O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-	if (ramfd < 0) {
-		perror("open\n");
+	struct psram_frame f = { .x = x, .cmd = cmd };
+
+	return PsramChip(&io->chip[i], io->mem[i], &f);
+}
+
+static int PsramXfer(struct psram_io *io, struct psram_req *req)
+{
+	uint32_t addr = req->addr, chipaddr, n;
+	struct psram_frame f = { .x = xport };
+	uint8_t *buf = req->buf;
+	int chip, len = req->len;
+
+	if (addr > io->ram_len || len > io->ram_len - addr)
 		return -1;
+
+	while (len) {
+		n = StripePiece(addr, len);
+		chip = psram_stripe(addr, nr_chips, stripe_unit, &chipaddr);
+		f.cmd = req->write ? xport->write : xport->read;
+		f.addr = chipaddr;
+		f.wait = req->write ? 0 : xport->read_wait;
+		f.data = buf;
+		f.len = n;
+		if (PsramChip(&io->chip[chip], io->mem[chip], &f) < 0)
+			return -1;
+		addr += n;
+		buf += n;
+		len -= n;
 	}
 
+	return req->len;
+}
+
+/* Run io->next, called with io->lock held and nobody else running it */
+static void PsramRunNext(struct psram_io *io)
+{
+	struct psram_req *req = io->next;
+
+	io->busy = 1;
+	pthread_mutex_unlock(&io->lock);
+
+	// the mapping only changes in load_images(), with the queue empty
+	req->ret = PsramXfer(io, req);
+
+	pthread_mutex_lock(&io->lock);
+	io->next = req->next;
+	io->busy = 0;
+}
+
+/*
+ * The pieces of a transfer run in parallel on their chips, each one after
+ * what its chip already has to do. Returns when the last one is done.
+ */
+static uint64_t PsramModel(struct psram_req *req)
+{
+	uint32_t addr = req->addr, chipaddr, n;
+	uint64_t start, cost, end = model_ns;
+	int chip, len = req->len;
+
+	while (len > 0) {
+		n = StripePiece(addr, len);
+		chip = psram_stripe(addr, nr_chips, stripe_unit, &chipaddr);
+		cost = SPI_SETUP_NS + psram_clocks(xport, n, req->write) * SPI_CLK_PS / 1000;
+		start = chip_busy[chip] > model_ns ? chip_busy[chip] : model_ns;
+		chip_busy[chip] = start + cost;
+		chip_xfers[chip]++;
+		chip_ns[chip] += cost;
+		if (chip_busy[chip] > end)
+			end = chip_busy[chip];
+		addr += n;
+		len -= n;
+	}
+
+	return end;
+}
+
+/* Sum of the data transfers of all chips */
+static void PsramStat(struct cost_psram *ps)
+{
+	int i, j;
+
+	memset(ps, 0, sizeof(*ps));
+	for (i = 0; i < nr_chips; i++) {
+		for (j = 0; j < 2; j++) {
+			ps->xfers[j] += io.chip[i].stat.xfers[j];
+			ps->overhead[j] += io.chip[i].stat.overhead[j];
+			ps->payload[j] += io.chip[i].stat.payload[j];
+		}
+	}
+}
+
+static void PsramReport(FILE *f)
+{
+	struct cost_psram ps;
+	int i;
+
+	fprintf(f, "psram: %d chip(s), %"PRIu32" byte stripes, %s, %s bursts, %"PRIu64" us waited for\n",
+		nr_chips, stripe_unit, xport->name, psram_wrap ? "wrapped" : "linear", model_ns / 1000);
+	for (i = 0; i < nr_chips; i++)
+		fprintf(f, "  chip %d: %"PRIu64" transfers, %"PRIu64" us busy, %"PRIu64" clocks, %"PRIu64" errors\n",
+			i, chip_xfers[i], chip_ns[i] / 1000, io.chip[i].clocks, io.chip[i].errors);
+
+	PsramStat(&ps);
+	cost_report(f, &ps);
+}
+
+static void *PsramIO(void *arg)
+{
+	struct psram_io *io = arg;
+
+	pthread_mutex_lock(&io->lock);
+	while (!io->stop) {
+		if (io->next && !io->busy) {
+			PsramRunNext(io);
+			pthread_cond_signal(&io->done);
+		} else {
+			pthread_cond_wait(&io->work, &io->lock);
+		}
+	}
+	pthread_mutex_unlock(&io->lock);
+
+	return NULL;
+}
+
+/* Complete the requests that were run, run or wait for one if block */
+static int PsramComplete(int block)
+{
+	struct psram_req *req, *next;
+	int n = 0;
+
+	if (!io.head)
+		return 0;
+
+	pthread_mutex_lock(&io.lock);
+	while (block && io.next == io.head) {
+		if (!io.busy)
+			PsramRunNext(&io);
+		else
+			pthread_cond_wait(&io.done, &io.lock);
+	}
+	// let the I/O thread take care of the rest while the guest runs
+	if (!block && io.next && io.kick)
+		pthread_cond_signal(&io.work);
+	next = io.next;
+	pthread_mutex_unlock(&io.lock);
+
+	while (io.head && io.head != next) {
+		req = io.head;
+		io.head = req->next;
+		if (!io.head)
+			io.tail = NULL;
+		io.queued--;
+		model_head = (model_head + 1) % PSRAM_QUEUE_DEPTH;
+		req->pending = 0;
+		if (req->done)
+			req->done(req);
+		n++;
+	}
+
+	return n;
+}
+
+int psram_submit(struct psram_req *req)
+{
+	if (io.queued == PSRAM_QUEUE_DEPTH)
+		psram_wait(io.head);
+
+	model_end[(model_head + io.queued) % PSRAM_QUEUE_DEPTH] = PsramModel(req);
+	io.queued++;
+	req->pending = 1;
+	req->next = NULL;
+
+	pthread_mutex_lock(&io.lock);
+	if (io.tail)
+		io.tail->next = req;
+	else
+		io.head = req;
+	io.tail = req;
+	if (!io.next)
+		io.next = req;
+	pthread_mutex_unlock(&io.lock);
+
+	return 0;
+}
+
+int psram_poll(void)
+{
+	return PsramComplete(0);
+}
+
+void psram_wait(struct psram_req *req)
+{
+	struct psram_req *r;
+	int i = 0;
+
+	if (!req->pending)
+		return;
+
+	// the model waits for this one only, the chips go on with the rest
+	for (r = io.head; r != req; r = r->next)
+		i++;
+	if (model_end[(model_head + i) % PSRAM_QUEUE_DEPTH] > model_ns)
+		model_ns = model_end[(model_head + i) % PSRAM_QUEUE_DEPTH];
+
+	while (req->pending)
+		PsramComplete(1);
+}
+
+void psram_sync(void)
+{
+	while (io.head)
+		PsramComplete(1);
+}
+
+/*
+ * Bring the chips to the -p mode like port-esp.c does, a chip may still be
+ * in QPI from before a reboot.
+ */
+static void PsramSetup(void)
+{
+	int i;
+
+	for (i = 0; i < nr_chips; i++) {
+		if (io.chip[i].qpi)
+			PsramCmd(&io, i, &psram_xports[PSRAM_QPI], PSRAM_CMD_EXIT_QPI);
+		PsramCmd(&io, i, &psram_xports[PSRAM_SPI], PSRAM_CMD_RESET_EN);
+		PsramCmd(&io, i, &psram_xports[PSRAM_SPI], PSRAM_CMD_RESET);
+		if (xport == &psram_xports[PSRAM_QPI])
+			PsramCmd(&io, i, &psram_xports[PSRAM_SPI], PSRAM_CMD_ENTER_QPI);
+		if (psram_wrap)
+			PsramCmd(&io, i, xport, PSRAM_CMD_WRAP_TOGGLE);
+	}
+}
+
+int psram_init(void)
+{
+	PsramSetup();
+	if (io.tid)
+		return 0;
+
+	pthread_mutex_init(&io.lock, NULL);
+	pthread_cond_init(&io.work, NULL);
+	pthread_cond_init(&io.done, NULL);
+	io.kick = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	if (pthread_create(&io.tid, NULL, PsramIO, &io))
+		return -1;
+
 	return 0;
 }
 
+/* Stop the I/O thread of this VM, before its thread exits */
+static void PsramExit(void)
+{
+	if (!io.tid)
+		return;
+
+	psram_sync();
+	pthread_mutex_lock(&io.lock);
+	io.stop = 1;
+	pthread_cond_signal(&io.work);
+	pthread_mutex_unlock(&io.lock);
+	pthread_join(io.tid, NULL);
+}
+
+// striped or compressed RAM is not linear
+void *psram_map(void)
+{
+	return nr_chips == 1 && !zram_budget ? ram : NULL;
+}
+
+/*
+ * Waiting for the queue is an artifact of the I/O thread, in the model a
+ * blocking transfer only waits for its own chips.
+ */
 int psram_read(uint32_t addr, void *buf, int len)
 {
-	lseek(ramfd, addr, SEEK_SET);
-	read(ramfd, buf, len);
+	struct psram_req req = { .addr = addr, .buf = buf, .len = len };
+
+	psram_sync();
+	model_ns = PsramModel(&req);
+	return PsramXfer(&io, &req);
 }
 
 int psram_write(uint32_t addr, void *buf, int len)
 {
-	lseek(ramfd, addr, SEEK_SET);
-	write(ramfd, buf, len);
+	struct psram_req req = { .addr = addr, .buf = buf, .len = len, .write = 1 };
+
+	psram_sync();
+	model_ns = PsramModel(&req);
+	return PsramXfer(&io, &req);
+}
+
+static int ImageFd(int ram_size)
+{
+	char path[] = "/tmp/uc-rv32ima-XXXXXX";
+	long flen = kernel_end - kernel_start;
+	int fd;
+
+	pthread_mutex_lock(&image_lock);
+	if (imagefd < 0) {
+		fd = mkstemp(path);
+		if (fd >= 0) {
+			unlink(path);
+			if (write(fd, kernel_start, flen) == flen && ftruncate(fd, ram_size) == 0)
+				imagefd = fd;
+			else
+				close(fd);
+		}
+	}
+	pthread_mutex_unlock(&image_lock);
+
+	return imagefd;
+}
+
+/* Give every chip a fresh store and copy the kernel over them */
+static int StripeImage(long flen)
+{
+	uint32_t addr, chipaddr, n;
+	int i, chip;
+
+	for (i = 0; i < nr_chips; i++) {
+		if (io.mem[i])
+			munmap(io.mem[i], ram_len / nr_chips);
+		io.mem[i] = mmap(NULL, ram_len / nr_chips, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (io.mem[i] == MAP_FAILED) {
+			io.mem[i] = NULL;
+			perror("mmap");
+			return -1;
+		}
+	}
+
+	for (addr = 0; addr < flen; addr += n) {
+		n = StripePiece(addr, flen - addr);
+		chip = psram_stripe(addr, nr_chips, stripe_unit, &chipaddr);
+		memcpy(io.mem[chip] + chipaddr, ram + addr, n);
+	}
+
+	return 0;
 }
 
 int load_images(int ram_size, int *kern_len)
 {
 	long flen;
+	int fd;
 
 	flen = kernel_end - kernel_start;
 	if (flen > ram_size) {
@@ -120,13 +1112,312 @@ int load_images(int ram_size, int *kern_len)
 	if (kern_len)
 		*kern_len = flen;
 
-	write(ramfd, kernel_start, flen);
+	fd = ImageFd(ram_size);
+	if (fd < 0) {
+		perror("kernel image");
+		return -1;
+	}
+
+	pthread_mutex_lock(&image_lock);
+	if (!kernel_rom && !kernel_copy) {
+		void *p = mmap(NULL, flen, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (p != MAP_FAILED)
+			kernel_rom = p;
+	}
+	pthread_mutex_unlock(&image_lock);
+	// RAM holds the kernel as well, it doesn't matter if this fails
+	cache_rom(kernel_rom, flen);
+
+	if (zram_budget)
+		return zram_load(ram_size, kernel_start, flen);
+
+	// a fresh mapping on every (re)boot, so RAM starts out as a clean image
+	psram_sync();
+	if (ram)
+		munmap(ram, ram_len);
+	ram = mmap(NULL, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (ram == MAP_FAILED) {
+		ram = NULL;
+		ram_len = 0;
+		perror("mmap");
+		return -1;
+	}
+	ram_len = ram_size;
+	io.ram_len = ram_len;
+
+	if (nr_chips == 1)
+		io.mem[0] = ram;
+	else if (StripeImage(flen) < 0)
+		return -1;
 
 	return 0;
 }
 
+int blkdev_init(uint64_t *nr_sectors)
+{
+	int ro = 0;
+	off_t size;
+
+	if (!blkdev_path)
+		return -1;
+
+	// several VMs sharing one disk must not write to it
+	if (nr_vms == 1)
+		blkfd = open(blkdev_path, O_RDWR);
+	if (blkfd < 0) {
+		blkfd = open(blkdev_path, O_RDONLY);
+		ro = 1;
+	}
+	if (blkfd < 0) {
+		perror(blkdev_path);
+		return -1;
+	}
+
+	size = lseek(blkfd, 0, SEEK_END);
+	*nr_sectors = size / 512;
+
+	return ro;
+}
+
+int blkdev_read(uint64_t sector, void *buf, int count)
+{
+	if (pread(blkfd, buf, count * 512, sector * 512) != count * 512)
+		return -1;
+	return count;
+}
+
+int blkdev_write(uint64_t sector, void *buf, int count)
+{
+	if (pwrite(blkfd, buf, count * 512, sector * 512) != count * 512)
+		return -1;
+	return count;
+}
+
+/* Run one VM, its console goes to vm<id>.log */
+static void *VMThread(void *arg)
+{
+	int id = (intptr_t)arg;
+	char path[32];
+	int i;
+
+	snprintf(path, sizeof(path), "vm%d.log", id);
+	uart_console = fopen(path, "w");
+	if (uart_console) {
+		app_main();
+		PsramReport(uart_console);
+		fclose(uart_console);
+	} else {
+		perror(path);
+	}
+
+	PsramExit();
+	for (i = 0; nr_chips > 1 && i < nr_chips; i++)
+		if (io.mem[i])
+			munmap(io.mem[i], ram_len / nr_chips);
+	if (ram)
+		munmap(ram, ram_len);
+	if (blkfd >= 0)
+		close(blkfd);
+	close(eventfd[0]);
+	close(eventfd[1]);
+
+	pthread_mutex_lock(&vm_lock);
+	vms_running--;
+	pthread_cond_signal(&vm_exited);
+	pthread_mutex_unlock(&vm_lock);
+
+	return NULL;
+}
+
+/*
+ * All VM state is thread local, so each VM gets a new thread and starts from
+ * the initial state. At most nr_jobs of them run at the same time.
+ */
+static void RunVMs(void)
+{
+	pthread_t tid;
+	int i;
+
+	for (i = 0; i < nr_vms; i++) {
+		pthread_mutex_lock(&vm_lock);
+		while (vms_running == nr_jobs)
+			pthread_cond_wait(&vm_exited, &vm_lock);
+		vms_running++;
+		pthread_mutex_unlock(&vm_lock);
+
+		if (pthread_create(&tid, NULL, VMThread, (void *)(intptr_t)i)) {
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_detach(tid);
+	}
+
+	pthread_mutex_lock(&vm_lock);
+	while (vms_running)
+		pthread_cond_wait(&vm_exited, &vm_lock);
+	pthread_mutex_unlock(&vm_lock);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b disk.img] [-d] [-f] [-i ratio] [-n vms] [-j jobs] [-s harts] [-c n[,unit]] [-p mode[,wrap]] [-m key=val,...] [-F on|hist] [-P period] [-t trace.bin] [-z kb] [-R] [-x script [-o out.json]]\n", prog);
+	fprintf(stderr, "  -b disk.img  back the virtio-blk device with disk.img\n");
+	fprintf(stderr, "  -d           print the device tree of the emulated machine and exit\n");
+	fprintf(stderr, "  -f           skip idle time to the next timer event, for benchmarking\n");
+	fprintf(stderr, "  -i ratio     advance the guest timer one tick every ratio instructions\n");
+	fprintf(stderr, "  -n vms       run vms machines without a console, VM n logs to vmn.log\n");
+	fprintf(stderr, "  -j jobs      run at most jobs machines at the same time, default: online cpus\n");
+	fprintf(stderr, "  -s harts     emulate harts harts, one host thread each, up to %d\n", SMP_MAX_HARTS);
+	fprintf(stderr, "  -c n[,unit]  stripe RAM over n simulated PSRAM chips in unit bytes, default 64\n");
+	fprintf(stderr, "  -p mode      talk to the PSRAM in mode spi or qpi, wrap for 32 byte wrapped bursts\n");
+	fprintf(stderr, "  -m key=val   parameters of the device time predictor printed on exit\n");
+	cost_usage(stderr);
+	fprintf(stderr, "  -F on        run common instruction pairs as one\n");
+	fprintf(stderr, "  -F hist      count pairs of consecutive instructions, printed on exit\n");
+	fprintf(stderr, "  -P period    sample the guest PC and call stack every period instructions,\n");
+	fprintf(stderr, "               printed on exit, see tools/profile-fold.py\n");
+	fprintf(stderr, "  -t trace.bin record events, written on exit and on SIGUSR1, see tools/trace2json.py\n");
+	fprintf(stderr, "  -R           copy the kernel to RAM instead of reading it from a read only mapping\n");
+	fprintf(stderr, "  -z kb        keep RAM compressed in at most kb KB of host memory instead of PSRAM\n");
+	fprintf(stderr, "  -x script    benchmark: type and expect what script says, see tools/boot.bench\n");
+	fprintf(stderr, "  -o out.json  where -x writes the numbers of each phase, default bench.json\n");
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
-	CaptureKeyboardInput();
+	char *end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:c:dF:fi:j:m:n:o:p:P:Rs:t:x:z:")) != -1) {
+		switch (opt) {
+		case 'b':
+			blkdev_path = optarg;
+			break;
+		case 'c':
+			nr_chips = strtol(optarg, &end, 0);
+			if (*end == ',')
+				stripe_unit = strtoul(end + 1, NULL, 0);
+			if (nr_chips < 1 || nr_chips > PSRAM_MAX_CHIPS || (nr_chips & (nr_chips - 1)) ||
+			    stripe_unit < 4 || stripe_unit > 64 || (stripe_unit & (stripe_unit - 1)))
+				usage(argv[0]);
+			break;
+		case 'd':
+			dump_dt = 1;
+			break;
+		case 'f':
+			idle_fastforward = 1;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "on"))
+				fusion_on = 1;
+			else if (!strcmp(optarg, "hist"))
+				fusion_hist = 1;
+			else
+				usage(argv[0]);
+			break;
+		case 'i':
+			icount_ratio = strtoul(optarg, NULL, 0);
+			if (!icount_ratio)
+				usage(argv[0]);
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			if (nr_jobs < 1)
+				usage(argv[0]);
+			break;
+		case 'p':
+			end = strchr(optarg, ',');
+			if (end) {
+				*end++ = 0;
+				if (strcmp(end, "wrap"))
+					usage(argv[0]);
+				psram_wrap = 1;
+			}
+			if (!strcmp(optarg, "qpi"))
+				xport = &psram_xports[PSRAM_QPI];
+			else if (strcmp(optarg, "spi"))
+				usage(argv[0]);
+			break;
+		case 'P':
+			prof_period = strtoul(optarg, NULL, 0);
+			if (!prof_period)
+				usage(argv[0]);
+			break;
+		case 'm':
+			if (cost_parse(optarg) < 0)
+				usage(argv[0]);
+			break;
+		case 'o':
+			bench.out = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'x':
+			bench.script = optarg;
+			break;
+		case 'R':
+			kernel_copy = 1;
+			break;
+		case 'z':
+			zram_budget = strtoul(optarg, NULL, 0) * 1024;
+			if (!zram_budget)
+				usage(argv[0]);
+			break;
+		case 'n':
+			nr_vms = atoi(optarg);
+			if (nr_vms < 1)
+				usage(argv[0]);
+			break;
+		case 's':
+			nr_harts = atoi(optarg);
+			if (nr_harts < 1 || nr_harts > SMP_MAX_HARTS)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	// per hart clocks would drift apart, one VM per thread leaves no room for harts
+	// and the harts share RAM through psram_map(), which striped or compressed RAM can't give
+	if (nr_harts > 1 && (nr_vms > 1 || idle_fastforward || icount_ratio || nr_chips > 1 || zram_budget))
+		usage(argv[0]);
+
+	// one console to script, one trace ring
+	if ((bench.script || trace_path) && nr_vms > 1)
+		usage(argv[0]);
+
+	if (trace_path && trace_start(trace_path) < 0) {
+		perror("trace");
+		return 1;
+	}
+
+	if (nr_vms > 1) {
+		if (!nr_jobs)
+			nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nr_jobs < 1)
+			nr_jobs = 1;
+		RunVMs();
+		return 0;
+	}
+
+	if (bench.script) {
+		if (!bench.out)
+			bench.out = "bench.json";
+		uart_console = OpenConsole();
+		if (!uart_console) {
+			perror("console");
+			return 1;
+		}
+		BenchStat(&bench.mark);
+	} else {
+		CaptureKeyboardInput();
+	}
 	app_main();
+	PsramReport(stdout);
+
+	return bench.script ? BenchWrite() : 0;
 }
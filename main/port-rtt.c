@@ -7,24 +7,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <fcntl.h>
 
 #include "rtthread.h"
 #include "drv_spi.h"
 #include "drv_pin.h"
 #include "termios.h"
 
+#include "cache.h"
 #include "psram.h"
+#include "uart.h"
+#include "zram.h"
 
-extern struct MiniRV32IMAState core;
+extern __vm struct MiniRV32IMAState core;
 extern void DumpState(struct MiniRV32IMAState *core);
 extern void app_main(void);
 extern char kernel_start[], kernel_end[];
 //#define kernel_start 0x60000
 //#define kernel_end 0x1e3b94
 
-static int is_eofd;
-
 static void ResetKeyboardInput(void)
 {
 	// Re-enable echo, etc. on keyboard.
@@ -54,41 +55,57 @@ static void CaptureKeyboardInput(void)
 	tcsetattr(0, TCSANOW, &term);
 }
 
+/* released by the KB reader to wake up WaitForEvent() */
+static rt_sem_t event_sem;
+
 uint64_t GetTimeMicroseconds()
 {
 	return rt_tick_get_millisecond();
 }
 
-int ReadKBByte(void)
+static void SignalEvent(void)
+{
+	rt_sem_release(event_sem);
+}
+
+static void KBReader(void *arg)
 {
+	struct uart_rx *rx = arg;
 	char rxchar;
-	int rread;
 
-	if (is_eofd)
-		return 0xffffffff;
+	while (read(0, &rxchar, 1) > 0) {
+		uart_rx_push(rx, rxchar);
+		SignalEvent();
+	}
+	uart_rx_eof(rx);
+	SignalEvent();
+}
 
-	rread = read(0, &rxchar, 1);
+void WaitForEvent(uint64_t timeout_us)
+{
+	rt_int32_t ticks = rt_tick_from_millisecond(timeout_us / 1000);
 
-	if (rread > 0) // Tricky: getchar can't be used with arrow keys.
-		return rxchar;
-	else
-		return -1;
+	if (rt_sem_take(event_sem, ticks ? ticks : 1) != RT_EOK)
+		return;
+	// one wakeup is enough for any number of events
+	while (rt_sem_trytake(event_sem) == RT_EOK)
+		;
 }
 
-int IsKBHit(void)
+int StartKBReader(void)
 {
-	int byteswaiting;
+	rt_thread_t tid;
 
-	if (is_eofd)
+	event_sem = rt_sem_create("event", 0, RT_IPC_FLAG_FIFO);
+	if (event_sem == RT_NULL)
 		return -1;
 
-	ioctl(0, FIONREAD, &byteswaiting);
-	// Is end-of-file for
-	if (!byteswaiting && write(0, 0, 0 ) != 0) {
-		is_eofd = 1;
+	tid = rt_thread_create("kbreader", KBReader, uart_rx_ring(), 1024,
+			       RT_THREAD_PRIORITY_MAX / 2, 10);
+	if (tid == RT_NULL)
 		return -1;
-	}
-	return !!byteswaiting;
+
+	return rt_thread_startup(tid);
 }
 
 #define SPI_HOST	"spi6"
@@ -96,13 +113,6 @@ int IsKBHit(void)
 #define GPIO_CS		(3*32+23)
 #define SPI_FREQ	48000000; // 48MHz
 
-#define CMD_WRITE	0x02
-#define CMD_READ	0x03
-#define CMD_FAST_READ	0x0b
-#define CMD_RESET_EN	0x66
-#define CMD_RESET	0x99
-#define CMD_READ_ID	0x9f
-
 static struct rt_spi_device *spi_dev;
 
 static void psram_send_cmd(struct rt_spi_device *h, const uint8_t cmd)
@@ -119,8 +129,8 @@ static void psram_read_id(struct rt_spi_device *h, uint8_t *rxdata)
 	struct rt_spi_message msg = { };
 	uint8_t cmd[4];
 
-	/* CMD_READ_ID with 24bit dummy addr */
-	cmd[0] = CMD_READ_ID;
+	/* PSRAM_CMD_READ_ID with 24bit dummy addr */
+	cmd[0] = PSRAM_CMD_READ_ID;
 	msg.send_buf = &cmd;
 	msg.length = sizeof(cmd);
 	rt_spi_transfer_message(h, &msg);
@@ -156,8 +166,8 @@ int psram_init(void)
 	rt_thread_mdelay(1);
 
 	rt_pin_write(GPIO_CS, PIN_LOW);
-	psram_send_cmd(spi_dev, CMD_RESET_EN);
-	psram_send_cmd(spi_dev, CMD_RESET);
+	psram_send_cmd(spi_dev, PSRAM_CMD_RESET_EN);
+	psram_send_cmd(spi_dev, PSRAM_CMD_RESET);
 	rt_pin_write(GPIO_CS, PIN_HIGH);
 	rt_thread_mdelay(1);
 
@@ -175,7 +185,7 @@ int psram_read(uint32_t addr, void *buf, int len)
 	/* cmdaddr[4] is dummy cycle */
 	uint8_t cmdaddr[5];
 
-	cmdaddr[0] = CMD_FAST_READ;
+	cmdaddr[0] = PSRAM_CMD_FAST_READ;
 	cmdaddr[1] = (addr >> 16) & 0xff;
 	cmdaddr[2] = (addr >> 8) & 0xff;
 	cmdaddr[3] = (addr >> 0) & 0xff;
@@ -202,7 +212,7 @@ int psram_write(uint32_t addr, void *buf, int len)
 	struct rt_spi_message msg = { };
 	uint8_t cmdaddr[4];
 
-	cmdaddr[0] = CMD_WRITE;
+	cmdaddr[0] = PSRAM_CMD_WRITE;
 	cmdaddr[1] = (addr >> 16) & 0xff;
 	cmdaddr[2] = (addr >> 8) & 0xff;
 	cmdaddr[3] = (addr >> 0) & 0xff;
@@ -223,6 +233,66 @@ int psram_write(uint32_t addr, void *buf, int len)
 	return len;
 }
 
+// PSRAM is behind SPI
+void *psram_map(void)
+{
+	return NULL;
+}
+
+/*
+ * The SPI driver has no queued transfers, so requests run when they are
+ * submitted and only their completion waits for psram_poll().
+ */
+static struct psram_req *done_head, *done_tail;
+
+int psram_submit(struct psram_req *req)
+{
+	if (req->write)
+		req->ret = psram_write(req->addr, req->buf, req->len);
+	else
+		req->ret = psram_read(req->addr, req->buf, req->len);
+
+	req->pending = 1;
+	req->next = NULL;
+	if (done_tail)
+		done_tail->next = req;
+	else
+		done_head = req;
+	done_tail = req;
+
+	return 0;
+}
+
+int psram_poll(void)
+{
+	struct psram_req *req;
+	int n = 0;
+
+	while (done_head) {
+		req = done_head;
+		done_head = req->next;
+		if (!done_head)
+			done_tail = NULL;
+		req->pending = 0;
+		if (req->done)
+			req->done(req);
+		n++;
+	}
+
+	return n;
+}
+
+void psram_wait(struct psram_req *req)
+{
+	if (req->pending)
+		psram_poll();
+}
+
+void psram_sync(void)
+{
+	psram_poll();
+}
+
 int load_images(int ram_size, int *kern_len)
 {
 	int flen;
@@ -240,7 +310,20 @@ int load_images(int ram_size, int *kern_len)
 		*kern_len = flen;
 
 	addr = 0;
-	flashaddr = kernel_start;
+	// the kernel is executed in place, only its last partial line goes to PSRAM
+	if (cache_rom(kernel_start, flen) == 0) {
+		addr = flen & ~0x3f;
+		flen &= 0x3f;
+	}
+	flashaddr = kernel_start + addr;
+	if (zram_budget) {
+		// the flash is memory mapped, no bounce buffer needed
+		printf("loading kernel Image (%d bytes) from flash:%lx into zram:%lx\n", flen, (uint32_t)flashaddr, addr);
+		if (zram_load(ram_size, NULL, 0) < 0)
+			return -1;
+		zram_write(addr, flashaddr, flen);
+		return zram_failed ? -1 : 0;
+	}
 	printf("loading kernel Image (%d bytes) from flash:%lx into psram:%lx\n", flen, (uint32_t)flashaddr, addr);
 	while (flen >= 64) {
 		memcpy(dmabuf, flashaddr, 64);
@@ -257,6 +340,40 @@ int load_images(int ram_size, int *kern_len)
 	return 0;
 }
 
+#define BLKDEV_PATH	"/rootfs.img"
+
+static int blkfd = -1;
+
+int blkdev_init(uint64_t *nr_sectors)
+{
+	off_t size;
+
+	blkfd = open(BLKDEV_PATH, O_RDWR);
+	if (blkfd < 0)
+		return -1;
+
+	size = lseek(blkfd, 0, SEEK_END);
+	*nr_sectors = size / 512;
+
+	return 0;
+}
+
+int blkdev_read(uint64_t sector, void *buf, int count)
+{
+	lseek(blkfd, sector * 512, SEEK_SET);
+	if (read(blkfd, buf, count * 512) != count * 512)
+		return -1;
+	return count;
+}
+
+int blkdev_write(uint64_t sector, void *buf, int count)
+{
+	lseek(blkfd, sector * 512, SEEK_SET);
+	if (write(blkfd, buf, count * 512) != count * 512)
+		return -1;
+	return count;
+}
+
 #if 0
 static void psram_test(void)
 {
@@ -7,9 +7,46 @@
 #ifndef PORT_H
 #define PORT_H
 
+#include <stdint.h>
+
+/*
+ * Marks the state of one emulated machine. The posix port can run several
+ * machines in one process, each on its own thread, so there it is thread
+ * local. The MCU ports run a single machine and don't pay for it. The
+ * posix port can also run one machine with several harts, see smp.h.
+ */
+#if defined(__linux__) || defined(__APPLE__)
+#define __vm		__thread
+#define CONFIG_SMP	1
+/* count what the device time predictor needs, see costmodel.h */
+#define CONFIG_COSTMODEL	1
+/* the event ring, only the posix port can start it and write it out */
+#define CONFIG_TRACE	1
+/* run common instruction pairs as one, with -F on, see fusion.h */
+#define CONFIG_FUSION	1
+#else
+#define __vm
+#endif
+
 uint64_t GetTimeMicroseconds();
-int IsKBHit();
-int ReadKBByte();
+int StartKBReader(void);
+/*
+ * Sleep until the KB reader has new input or timeout_us passed, whichever
+ * is first. Input that arrived before the call makes it return immediately.
+ */
+void WaitForEvent(uint64_t timeout_us);
+
+#ifdef CONFIG_SMP
+/* Run fn(hart) on a new host thread, WaitForEvent() there waits for KickHart(hart) */
+int StartHart(void (*fn)(int hart), int hart);
+void KickHart(int hart);
+#endif
+
 int load_images(int ram_size, int *kern_len);
 
+/* block device backend, init returns 1 if read only, -1 if there is none */
+int blkdev_init(uint64_t *nr_sectors);
+int blkdev_read(uint64_t sector, void *buf, int count);
+int blkdev_write(uint64_t sector, void *buf, int count);
+
 #endif /* PORT_H */
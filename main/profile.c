@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "profile.h"
+
+#define RAM_BASE		0x80000000
+
+struct prof_stack {
+	uint32_t count;
+	uint32_t miss;
+	uint32_t pc[PROF_DEPTH];
+};
+
+uint32_t prof_period = PROF_PERIOD;
+
+static uint32_t ram_size;
+/* instructions since the last sample */
+static __vm uint32_t count;
+static __vm uint64_t samples, dropped;
+// only allocated once there is something to keep
+static __vm struct prof_stack *stacks;
+
+void prof_init(uint32_t size)
+{
+	ram_size = size;
+}
+
+uint32_t prof_slice(uint32_t slice)
+{
+	if (prof_period && prof_period - count < slice)
+		return prof_period - count;
+	return slice;
+}
+
+/*
+ * The RISC-V frame record sits right below fp: the caller's fp at fp - 8
+ * and the return address at fp - 4. Stacks grow down, so every caller's
+ * record is above the callee's, anything else ends the walk. The guest
+ * kernel needs CONFIG_FRAME_POINTER for this to find more than the PC.
+ */
+static int prof_walk(uint32_t *pc, uint32_t fp)
+{
+	uint32_t rec[2];
+	int n = 1;
+
+	while (n < PROF_DEPTH) {
+		if (fp & 3 || fp - RAM_BASE < 8 || fp - RAM_BASE > ram_size)
+			break;
+		// reads go through the cache, profiling shows up in its hit rate
+		cache_read_buf(fp - RAM_BASE - 8, rec, sizeof(rec));
+		// without frame pointers s0 is just another register
+		if (rec[1] - RAM_BASE >= ram_size)
+			break;
+		pc[n++] = rec[1];
+		if (rec[0] <= fp)
+			break;
+		fp = rec[0];
+	}
+
+	return n;
+}
+
+static void prof_sample(uint32_t pc, uint32_t fp, int missed)
+{
+	struct prof_stack *s;
+	uint32_t stack[PROF_DEPTH] = { pc };
+	uint32_t h = 2166136261u;
+	int i;
+
+	prof_walk(stack, fp);
+	for (i = 0; i < PROF_DEPTH; i++)
+		h = (h ^ stack[i]) * 16777619u;
+
+	samples++;
+	if (!stacks)
+		stacks = calloc(PROF_MAX_STACKS, sizeof(*stacks));
+	for (i = 0; stacks && i < PROF_MAX_STACKS; i++) {
+		s = &stacks[(h + i) % PROF_MAX_STACKS];
+		if (!s->count) {
+			memcpy(s->pc, stack, sizeof(stack));
+			break;
+		}
+		if (!memcmp(s->pc, stack, sizeof(stack)))
+			break;
+	}
+	if (!stacks || i == PROF_MAX_STACKS) {
+		dropped++;
+		return;
+	}
+
+	s->count++;
+	if (missed)
+		s->miss++;
+}
+
+void prof_account(uint32_t retired, uint32_t pc, uint32_t fp, int missed)
+{
+	if (!prof_period)
+		return;
+
+	count += retired;
+	if (count < prof_period)
+		return;
+	count = 0;
+	prof_sample(pc, fp, missed);
+}
+
+void prof_dump(FILE *f)
+{
+	struct prof_stack *s;
+	int i, j, k;
+
+	if (!prof_period)
+		return;
+
+	fprintf(f, "profile: %"PRIu32" instructions per sample, %"PRIu64" samples, %"PRIu64" dropped\n",
+		prof_period, samples, dropped);
+	for (i = 0; stacks && i < PROF_MAX_STACKS; i++) {
+		s = &stacks[i];
+		if (!s->count)
+			continue;
+		// a stack is split in two lines, samples with and without misses
+		for (j = 0; j < 2; j++) {
+			if (!(j ? s->miss : s->count - s->miss))
+				continue;
+			fprintf(f, "prof %"PRIu32" %d", j ? s->miss : s->count - s->miss, j);
+			for (k = 0; k < PROF_DEPTH && s->pc[k]; k++)
+				fprintf(f, " %08"PRIx32, s->pc[k]);
+			fprintf(f, "\n");
+		}
+	}
+}
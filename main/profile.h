@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "port.h"
+
+/* frames kept per sample, the PC included */
+#define PROF_DEPTH		8
+/* distinct stacks kept, samples of others are only counted as dropped */
+#if defined(__linux__) || defined(__APPLE__)
+#define PROF_MAX_STACKS		8192
+#else
+#define PROF_MAX_STACKS		512
+#endif
+
+/*
+ * Guest PC sampling: one sample every prof_period retired instructions,
+ * 0 turns it off. A sample is the PC plus the return addresses found by
+ * walking the guest frame pointers, and whether the slice it ended took
+ * cache misses. The histogram is printed by prof_dump() as lines of
+ *   prof <count> <miss> <pc> <caller> ...
+ * for tools/profile-fold.py.
+ */
+extern uint32_t prof_period;
+
+/* the MCU ports have no command line, build with -DPROF_PERIOD=n there */
+#ifndef PROF_PERIOD
+#define PROF_PERIOD		0
+#endif
+
+void prof_init(uint32_t ram_size);
+/* Cut slice so that it ends where the next sample is due */
+uint32_t prof_slice(uint32_t slice);
+/* Account retired instructions of the slice that just ran at pc with frame pointer fp */
+void prof_account(uint32_t retired, uint32_t pc, uint32_t fp, int missed);
+void prof_dump(FILE *f);
+
+#endif /* PROFILE_H */
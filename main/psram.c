@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+
+#include "psram.h"
+
+const struct psram_xport psram_xports[] = {
+	[PSRAM_SPI] = {
+		.name = "spi",
+		.read = PSRAM_CMD_FAST_READ,
+		.write = PSRAM_CMD_WRITE,
+		.cmd_lines = 1,
+		.addr_lines = 1,
+		.data_lines = 1,
+		.read_wait = 8,
+	},
+	[PSRAM_QPI] = {
+		.name = "qpi",
+		.read = PSRAM_CMD_QUAD_READ,
+		.write = PSRAM_CMD_QUAD_WRITE,
+		.cmd_lines = 4,
+		.addr_lines = 4,
+		.data_lines = 4,
+		.read_wait = 6,
+	},
+};
+
+uint32_t psram_clocks(const struct psram_xport *x, int len, int write)
+{
+	return 8 / x->cmd_lines + 24 / x->addr_lines + (write ? 0 : x->read_wait) +
+	       len * 8 / x->data_lines;
+}
+
+int psram_burst(uint32_t addr, int wrap)
+{
+	uint32_t size = wrap ? PSRAM_WRAP_SIZE : PSRAM_PAGE_SIZE;
+
+	return size - addr % size;
+}
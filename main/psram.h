@@ -7,8 +7,103 @@
 #ifndef PSRAM_H
 #define PSRAM_H
 
+#include <stdint.h>
+
+/* max number of requests in flight, psram_submit() waits for the oldest beyond that */
+#define PSRAM_QUEUE_DEPTH	8
+
+#define PSRAM_MAX_CHIPS		8
+
+/* PSRAM64H commands */
+#define PSRAM_CMD_WRITE		0x02
+#define PSRAM_CMD_READ		0x03
+#define PSRAM_CMD_FAST_READ	0x0b
+#define PSRAM_CMD_QUAD_WRITE	0x38
+#define PSRAM_CMD_QUAD_READ	0xeb
+#define PSRAM_CMD_ENTER_QPI	0x35
+#define PSRAM_CMD_EXIT_QPI	0xf5
+#define PSRAM_CMD_WRAP_TOGGLE	0xc0
+#define PSRAM_CMD_RESET_EN	0x66
+#define PSRAM_CMD_RESET		0x99
+#define PSRAM_CMD_READ_ID	0x9f
+
+/* a linear burst wraps at the end of a page, a wrapped one every 32 bytes */
+#define PSRAM_PAGE_SIZE		1024
+#define PSRAM_WRAP_SIZE		32
+
+/*
+ * A command set: the commands used for the data transfers, how many lines
+ * carry the command, address and data phases, and the wait clocks between
+ * address and read data.
+ */
+struct psram_xport {
+	const char *name;
+	uint8_t read, write;
+	uint8_t cmd_lines, addr_lines, data_lines;
+	uint8_t read_wait;
+};
+
+enum psram_mode {
+	PSRAM_SPI,	/* fast read and write, one line */
+	PSRAM_QPI,	/* quad read and write after PSRAM_CMD_ENTER_QPI, four lines */
+};
+
+extern const struct psram_xport psram_xports[];
+
+/* Bus clocks of a transfer of len bytes, from CS low to CS high */
+uint32_t psram_clocks(const struct psram_xport *x, int len, int write);
+/* Bytes a burst at addr can move before it wraps */
+int psram_burst(uint32_t addr, int wrap);
+
+/* a cache set spans this many address bits, see cache.c */
+#define PSRAM_STRIPE_SHIFT	11
+
+/*
+ * An asynchronous transfer. buf must stay untouched until the request is
+ * done: pending is cleared and done, if set, is called. That happens in
+ * psram_poll(), psram_wait() or psram_sync(), never behind the caller's
+ * back. Requests complete in the order they were submitted.
+ */
+struct psram_req {
+	uint32_t addr;
+	void *buf;
+	int len;
+	int write;
+	void (*done)(struct psram_req *req);
+	void *priv;
+	/* set by the port: len on success, -1 on error */
+	int ret;
+	int pending;
+	struct psram_req *next;
+};
+
 int psram_init(void);
+/* Blocking transfers, they wait for the requests in flight first */
 int psram_read(uint32_t addr, void *buf, int len);
 int psram_write(uint32_t addr, void *buf, int len);
+/* host address of the whole RAM if the port keeps it in host memory, NULL if not */
+void *psram_map(void);
+
+int psram_submit(struct psram_req *req);
+/* Complete the finished requests without blocking, returns how many */
+int psram_poll(void);
+/* Block until req, and so every request before it, is done */
+void psram_wait(struct psram_req *req);
+void psram_sync(void);
+
+/*
+ * Guest RAM striped over nr_chips chips, a power of two, in units of unit
+ * bytes, a power of two up to a cache line. Returns the chip of addr and
+ * the address inside it. The tag bits are folded into the chip number, so
+ * a victim line and its replacement, which share a set, are likely to be
+ * on different chips and the writeback can overlap with the refill.
+ */
+static inline int psram_stripe(uint32_t addr, int nr_chips, uint32_t unit, uint32_t *chipaddr)
+{
+	uint32_t s = addr / unit;
+
+	*chipaddr = s / nr_chips * unit + addr % unit;
+	return (s ^ (addr >> PSRAM_STRIPE_SHIFT)) & (nr_chips - 1);
+}
 
 #endif /* PSRAM_H */
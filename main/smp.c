@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <sched.h>
+
+#include "mmio.h"
+#include "plic.h"
+#include "port.h"
+#include "smp.h"
+
+#define MMIO_IDLE		0
+#define MMIO_POSTED		1
+#define MMIO_DONE		2
+
+int nr_harts = 1;
+__vm int hart_id;
+struct hart harts[SMP_MAX_HARTS];
+int smp_exit;
+
+#ifdef CONFIG_SMP
+/* Called by a secondary hart, run one MMIO access on hart 0 and wait for it */
+uint32_t smp_mmio(uint32_t addr, uint32_t val, int write)
+{
+	struct hart *h = &harts[hart_id];
+
+	h->mmio_addr = addr;
+	h->mmio_val = val;
+	h->mmio_write = write;
+	__atomic_store_n(&h->mmio_state, MMIO_POSTED, __ATOMIC_RELEASE);
+	KickHart(0);
+
+	// hart 0 picks it up between two of its slices
+	while (__atomic_load_n(&h->mmio_state, __ATOMIC_ACQUIRE) != MMIO_DONE) {
+		if (__atomic_load_n(&smp_exit, __ATOMIC_ACQUIRE))
+			return 0;
+		sched_yield();
+	}
+	h->mmio_state = MMIO_IDLE;
+
+	return write ? 0 : h->mmio_val;
+}
+
+/*
+ * Called by hart 0 between slices: run the accesses the other harts wait
+ * for and route the PLIC context outputs to them. Returns the syscon
+ * value if one of them asked for a poweroff or reboot.
+ */
+uint32_t smp_poll(void)
+{
+	uint32_t ret, stop = 0;
+	int i, meip;
+
+	for (i = 1; i < nr_harts; i++) {
+		struct hart *h = &harts[i];
+
+		if (__atomic_load_n(&h->mmio_state, __ATOMIC_ACQUIRE) == MMIO_POSTED) {
+			if (h->mmio_write) {
+				ret = mmio_write(h->mmio_addr, h->mmio_val);
+				if (ret)
+					stop = ret;
+			} else {
+				h->mmio_val = mmio_read(h->mmio_addr);
+			}
+			__atomic_store_n(&h->mmio_state, MMIO_DONE, __ATOMIC_RELEASE);
+		}
+
+		meip = plic_irq_pending(i);
+		if (__atomic_exchange_n(&h->meip, meip, __ATOMIC_ACQ_REL) != meip && meip)
+			KickHart(i);
+	}
+
+	return stop;
+}
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+#include "port.h"
+
+#define SMP_MAX_HARTS		8
+
+struct MiniRV32IMAState;
+
+/*
+ * Each hart runs on its own host thread, so its __vm state (core, timing)
+ * is its own. Devices only live on hart 0's thread, the other harts
+ * forward their MMIO accesses to it, except for the per hart CLINT.
+ */
+struct hart {
+	struct MiniRV32IMAState *state;
+	/* CLINT msip, written by any hart */
+	uint32_t msip;
+	/* output of the hart's PLIC context, written by hart 0 */
+	uint32_t meip;
+	/* MMIO access waiting for hart 0 */
+	uint32_t mmio_addr;
+	uint32_t mmio_val;
+	int mmio_write;
+	int mmio_state;
+};
+
+extern int nr_harts;
+extern __vm int hart_id;
+extern struct hart harts[SMP_MAX_HARTS];
+/* set by hart 0 on poweroff or reboot, the other harts leave their loop */
+extern int smp_exit;
+
+#ifdef CONFIG_SMP
+uint32_t smp_mmio(uint32_t addr, uint32_t val, int write);
+uint32_t smp_poll(void);
+#endif
+
+#endif /* SMP_H */
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmio.h"
+#include "port.h"
+#include "smp.h"
+#include "trace.h"
+
+int trace_on;
+volatile int trace_dump_req;
+
+/* shared by all harts of the machine, head only ever grows */
+static struct trace_ev *ring;
+static uint32_t head;
+static const char *trace_path;
+
+void trace_emit(int type, int id, uint32_t arg)
+{
+	struct trace_ev *ev;
+
+	ev = &ring[__atomic_fetch_add(&head, 1, __ATOMIC_RELAXED) % TRACE_ENTRIES];
+	ev->us = GetTimeMicroseconds();
+	ev->arg = arg;
+	ev->id = id;
+	ev->type = type;
+	ev->hart = hart_id;
+}
+
+int trace_start(const char *path)
+{
+	ring = calloc(TRACE_ENTRIES, sizeof(*ring));
+	if (!ring)
+		return -1;
+
+	trace_path = path;
+	trace_on = 1;
+	return 0;
+}
+
+void trace_dump(void)
+{
+	struct trace_hdr hdr = { .magic = TRACE_MAGIC };
+	char name[TRACE_NAME_LEN];
+	uint32_t end, n;
+	const char *s;
+	FILE *f;
+
+	if (!trace_on || !trace_path)
+		return;
+
+	f = fopen(trace_path, "wb");
+	if (!f) {
+		perror(trace_path);
+		return;
+	}
+
+	end = __atomic_load_n(&head, __ATOMIC_RELAXED);
+	n = end < TRACE_ENTRIES ? end : TRACE_ENTRIES;
+	while (mmio_dev_name(hdr.nr_devs))
+		hdr.nr_devs++;
+	hdr.nr_events = n;
+	hdr.lost = end - n;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	// NUL padded, a name of TRACE_NAME_LEN bytes is cut
+	for (n = 0; (s = mmio_dev_name(n)); n++) {
+		memset(name, 0, sizeof(name));
+		strncpy(name, s, sizeof(name) - 1);
+		fwrite(name, sizeof(name), 1, f);
+	}
+
+	// oldest first, the ring may have wrapped
+	n = hdr.nr_events;
+	if ((end - n) % TRACE_ENTRIES + n > TRACE_ENTRIES) {
+		fwrite(&ring[(end - n) % TRACE_ENTRIES], sizeof(*ring), TRACE_ENTRIES - (end - n) % TRACE_ENTRIES, f);
+		fwrite(ring, sizeof(*ring), end % TRACE_ENTRIES, f);
+	} else {
+		fwrite(&ring[(end - n) % TRACE_ENTRIES], sizeof(*ring), n, f);
+	}
+
+	fclose(f);
+	printf("trace: %"PRIu32" events written to %s\n", hdr.nr_events, trace_path);
+}
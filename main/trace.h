@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "port.h"
+
+/* ring size in events, a power of two */
+#define TRACE_ENTRIES		(1 << 20)
+
+enum trace_type {
+	TRACE_TRAP,		/* arg: mcause */
+	TRACE_MRET,
+	TRACE_WFI_ENTER,
+	TRACE_WFI_EXIT,
+	TRACE_MMIO_READ,	/* id: device, see mmio_dev_name(), arg: offset */
+	TRACE_MMIO_WRITE,
+	TRACE_CACHE_MISS,	/* id: 1 for a store, arg: RAM offset */
+	TRACE_WRITEBACK,	/* arg: RAM offset */
+	TRACE_UART_TX,		/* arg: the byte */
+	TRACE_UART_RX,
+};
+
+/*
+ * One event, in host byte order in the dump. The dump starts with
+ * struct trace_hdr, then the device names, TRACE_NAME_LEN bytes each and NUL padded,
+ * then the events oldest first. tools/trace2json.py reads it.
+ */
+struct trace_ev {
+	uint64_t us;		/* host time */
+	uint32_t arg;
+	uint16_t id;
+	uint8_t type;
+	uint8_t hart;
+};
+
+#define TRACE_MAGIC		"uctrace1"
+#define TRACE_NAME_LEN		16
+
+struct trace_hdr {
+	char magic[8];
+	uint32_t nr_devs;
+	uint32_t nr_events;
+	/* events overwritten before the dump */
+	uint64_t lost;
+};
+
+#ifdef CONFIG_TRACE
+extern int trace_on;
+/* set from a signal handler to have hart 0 dump the ring between slices */
+extern volatile int trace_dump_req;
+
+void trace_emit(int type, int id, uint32_t arg);
+
+/* All a disabled trace point costs is this test */
+static inline void trace(int type, int id, uint32_t arg)
+{
+	if (__builtin_expect(trace_on, 0))
+		trace_emit(type, id, arg);
+}
+
+/* Allocate the ring and start tracing, trace_dump() writes to path */
+int trace_start(const char *path);
+void trace_dump(void);
+
+static inline void trace_poll(void)
+{
+	if (__builtin_expect(trace_dump_req, 0)) {
+		trace_dump_req = 0;
+		trace_dump();
+	}
+}
+#else
+/* no way to start or write out the ring, the trace points compile away */
+static inline void trace(int type, int id, uint32_t arg) { }
+static inline void trace_dump(void) { }
+static inline void trace_poll(void) { }
+#endif
+
+#endif /* TRACE_H */
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mmio.h"
+#include "plic.h"
+#include "trace.h"
+#include "uart.h"
+
+/* 8250 / 16550 registers, byte offset from UART_BASE */
+#define UART_RBR_THR		0
+#define UART_IER		1
+#define UART_IIR_FCR		2
+#define UART_LCR		3
+#define UART_MCR		4
+#define UART_LSR		5
+#define UART_MSR		6
+#define UART_SCR		7
+
+#define IER_RDI			(1 << 0)
+#define IER_THRI		(1 << 1)
+
+#define IIR_NO_INT		0x01
+#define IIR_THRI		0x02
+#define IIR_RDI			0x04
+#define IIR_FIFO_ENABLED	0xc0
+
+#define FCR_FIFO_ENABLE		(1 << 0)
+
+#define LCR_DLAB		(1 << 7)
+/* 16650+ extended register access, we have none of them */
+#define LCR_CONF_MODE_B		0xbf
+
+#define LSR_DR			(1 << 0)
+#define LSR_THRE		(1 << 5)
+#define LSR_TEMT		(1 << 6)
+
+__vm FILE *uart_console;
+
+static __vm uint8_t txbuf[UART_TXBUF_SIZE];
+static __vm uint32_t txlen;
+static __vm uint64_t tx_first_us;
+/* time of the last uart_tx_poll(), so the timeout follows the caller's clock */
+static __vm uint64_t uart_now;
+/*
+ * Set when the guest read LSR while the TX buffer was not empty. A second
+ * LSR read without a THR write in between means the guest is waiting for
+ * THRE or TEMT, so that is the time to drain the buffer instead of making
+ * it spin.
+ */
+static __vm int lsr_polled;
+
+static __vm struct uart_rx rx;
+
+static __vm uint8_t ier, fcr, lcr, mcr, scr, dll, dlm;
+/* THRE interrupt was reported by IIR, cleared by a THR or IER write */
+static __vm int thri_acked;
+
+void uart_tx_flush(void)
+{
+	if (!txlen)
+		return;
+
+	fwrite(txbuf, 1, txlen, uart_console);
+	fflush(uart_console);
+	txlen = 0;
+}
+
+void uart_tx_poll(uint64_t now)
+{
+	uart_now = now;
+	if (txlen && now - tx_first_us >= UART_TX_TIMEOUT_US)
+		uart_tx_flush();
+}
+
+struct uart_rx *uart_rx_ring(void)
+{
+	return &rx;
+}
+
+void uart_rx_push(struct uart_rx *rx, uint8_t c)
+{
+	uint32_t head = rx->head;
+
+	// Drop the byte when full, like a real FIFO overrun
+	if (head - __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE) == UART_RXBUF_SIZE)
+		return;
+
+	rx->buf[head % UART_RXBUF_SIZE] = c;
+	__atomic_store_n(&rx->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int uart_rx_room(struct uart_rx *rx)
+{
+	return UART_RXBUF_SIZE - (rx->head - __atomic_load_n(&rx->tail, __ATOMIC_ACQUIRE));
+}
+
+void uart_rx_eof(struct uart_rx *rx)
+{
+	__atomic_store_n(&rx->eof, 1, __ATOMIC_RELEASE);
+}
+
+int uart_rx_pending(void)
+{
+	return __atomic_load_n(&rx.head, __ATOMIC_ACQUIRE) != rx.tail;
+}
+
+int uart_getc(void)
+{
+	uint8_t c;
+
+	if (!uart_rx_pending())
+		return -1;
+
+	c = rx.buf[rx.tail % UART_RXBUF_SIZE];
+	__atomic_store_n(&rx.tail, rx.tail + 1, __ATOMIC_RELEASE);
+	trace(TRACE_UART_RX, 0, c);
+	return c;
+}
+
+static int uart_thri_pending(void)
+{
+	return (ier & IER_THRI) && txlen < UART_TXBUF_SIZE && !thri_acked;
+}
+
+void uart_update_irq(void)
+{
+	int level;
+
+	level = ((ier & IER_RDI) && uart_rx_pending()) || uart_thri_pending();
+	plic_set_irq(UART_IRQ, level);
+}
+
+static uint32_t uart_iir(void)
+{
+	uint32_t iir = (fcr & FCR_FIFO_ENABLE) ? IIR_FIFO_ENABLED : 0;
+
+	if ((ier & IER_RDI) && uart_rx_pending())
+		return iir | IIR_RDI;
+	if (uart_thri_pending()) {
+		thri_acked = 1;
+		return iir | IIR_THRI;
+	}
+	return iir | IIR_NO_INT;
+}
+
+static uint32_t uart_lsr(void)
+{
+	uint32_t lsr = 0;
+
+	if (txlen && lsr_polled)
+		uart_tx_flush();
+	lsr_polled = !!txlen;
+
+	if (txlen < UART_TXBUF_SIZE)
+		lsr |= LSR_THRE;
+	if (!txlen)
+		lsr |= LSR_TEMT;
+
+	if (uart_rx_pending())
+		lsr |= LSR_DR;
+	// EOF on the host side is reported as all ones, as before
+	else if (__atomic_load_n(&rx.eof, __ATOMIC_ACQUIRE))
+		return 0xffffffff;
+
+	return lsr;
+}
+
+static void uart_tx(uint8_t val)
+{
+	// The guest ignored THRE, drain the buffer rather than drop the byte
+	if (txlen == UART_TXBUF_SIZE)
+		uart_tx_flush();
+
+	trace(TRACE_UART_TX, 0, val);
+	if (!txlen)
+		tx_first_us = uart_now;
+	txbuf[txlen++] = val;
+	lsr_polled = 0;
+	thri_acked = 0;
+
+	if (val == '\n')
+		uart_tx_flush();
+}
+
+static uint32_t uart_read(void *opaque, uint32_t ofs)
+{
+	uint32_t val;
+
+	if (lcr == LCR_CONF_MODE_B && ofs != UART_LCR)
+		return 0;
+
+	switch (ofs) {
+	case UART_RBR_THR:
+		if (lcr & LCR_DLAB)
+			return dll;
+		val = uart_getc();
+		if (val == (uint32_t)-1)
+			val = 0;
+		break;
+	case UART_IER:
+		return (lcr & LCR_DLAB) ? dlm : ier;
+	case UART_IIR_FCR:
+		val = uart_iir();
+		break;
+	case UART_LCR:
+		return lcr;
+	case UART_MCR:
+		return mcr;
+	case UART_LSR:
+		return uart_lsr();
+	case UART_SCR:
+		return scr;
+	default:
+		return 0;
+	}
+
+	uart_update_irq();
+	return val;
+}
+
+static uint32_t uart_write(void *opaque, uint32_t ofs, uint32_t val)
+{
+	if (lcr == LCR_CONF_MODE_B && ofs != UART_LCR)
+		return 0;
+
+	switch (ofs) {
+	case UART_RBR_THR:
+		if (lcr & LCR_DLAB)
+			dll = val;
+		else
+			uart_tx(val);
+		break;
+	case UART_IER:
+		if (lcr & LCR_DLAB) {
+			dlm = val;
+		} else {
+			ier = val & 0x0f;
+			thri_acked = 0;
+		}
+		break;
+	case UART_IIR_FCR:
+		fcr = val;
+		break;
+	case UART_LCR:
+		lcr = val;
+		break;
+	case UART_MCR:
+		mcr = val;
+		break;
+	case UART_SCR:
+		scr = val;
+		break;
+	default:
+		break;
+	}
+
+	uart_update_irq();
+	return 0;
+}
+
+static void uart_dt_props(FILE *f, struct mmio_dev *dev)
+{
+	fprintf(f, "\t\t\tclock-frequency = <0x1000000>;\n");
+}
+
+static struct mmio_dev uart_dev = {
+	.name = "uart",
+	.compatible = "\"ns16850\"",
+	.base = UART_BASE,
+	.size = UART_SIZE,
+	.irq = UART_IRQ,
+	.read = uart_read,
+	.write = uart_write,
+	.dt_props = uart_dt_props,
+};
+
+void uart_init(void)
+{
+	if (!uart_console)
+		uart_console = stdout;
+	mmio_register(&uart_dev);
+}
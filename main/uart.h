@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef UART_H
+#define UART_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "port.h"
+
+#define UART_BASE		0x10000000
+#define UART_SIZE		0x100
+
+/* host side TX buffer, flushed on '\n', when full, on timeout or on WFI */
+#define UART_TXBUF_SIZE		256
+#define UART_TX_TIMEOUT_US	20000
+/* host side RX ring, must be a power of two */
+#define UART_RXBUF_SIZE		256
+
+/*
+ * Host side RX ring, filled by the port's keyboard reader, which may be
+ * another thread or an ISR, and drained by the emulator. head and tail
+ * each have a single writer.
+ */
+struct uart_rx {
+	uint8_t buf[UART_RXBUF_SIZE];
+	uint32_t head, tail;
+	int eof;
+};
+
+/* where the guest console goes, stdout unless the port set it before uart_init() */
+extern __vm FILE *uart_console;
+
+void uart_init(void);
+void uart_tx_flush(void);
+void uart_tx_poll(uint64_t now);
+void uart_update_irq(void);
+
+/* the ring of this machine, for the port to hand to its keyboard reader */
+struct uart_rx *uart_rx_ring(void);
+void uart_rx_push(struct uart_rx *rx, uint8_t c);
+/* free space in the ring, uart_rx_push() drops bytes beyond that */
+int uart_rx_room(struct uart_rx *rx);
+void uart_rx_eof(struct uart_rx *rx);
+
+int uart_rx_pending(void);
+int uart_getc(void);
+
+#endif /* UART_H */
@@ -13,19 +13,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
 
 #include "port.h"
 #include "cache.h"
+#include "costmodel.h"
+#include "fusion.h"
+#include "hpm.h"
 #include "psram.h"
+#include "mmio.h"
+#include "plic.h"
+#include "profile.h"
+#include "smp.h"
+#include "trace.h"
+#include "uart.h"
+#include "virtio.h"
+#include "virtio-blk.h"
+#include "virtio-console.h"
+#include "zram.h"
 
 static uint32_t ram_amt = 8 * 1024 * 1024;
 
 static uint32_t HandleException(uint32_t ir, uint32_t retval);
-static uint32_t HandleControlStore(uint32_t addy, uint32_t val);
-static uint32_t HandleControlLoad(uint32_t addy );
-static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value);
-static int32_t HandleOtherCSRRead(uint8_t *image, uint16_t csrno);
-static void MiniSleep();
+static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value, uint32_t cycle);
+static int32_t HandleOtherCSRRead(uint8_t *image, uint16_t csrno, uint32_t cycle);
+static int SliceBreak(void);
+static uint32_t BusRead(uint32_t addr);
+static uint32_t BusWrite(uint32_t addr, uint32_t val);
 
 // This is the functionality we want to override in the emulator.
 //  think of this as the way the emulator's processor is connected to the outside world.
@@ -33,10 +47,22 @@ static void MiniSleep();
 #define MINI_RV32_RAM_SIZE ram_amt
 #define MINIRV32_IMPLEMENTATION
 #define MINIRV32_POSTEXEC(pc, ir, retval) { if (retval > 0) {  retval = HandleException(ir, retval); } }
-#define MINIRV32_HANDLE_MEM_STORE_CONTROL(addy, val) if (HandleControlStore(addy, val)) return val;
-#define MINIRV32_HANDLE_MEM_LOAD_CONTROL(addy, rval) rval = HandleControlLoad(addy);
-#define MINIRV32_OTHERCSR_WRITE(csrno, value) HandleOtherCSRWrite(image, csrno, value);
-#define MINIRV32_OTHERCSR_READ(csrno, value) value = HandleOtherCSRRead(image, csrno);
+#define MINIRV32_HANDLE_MEM_STORE_CONTROL(addy, val) { uint32_t stop = BusWrite(addy, val); if (stop) { SETCSR(pc, pc + 4); return stop; } if (SliceBreak()) count = icount + 1; }
+#define MINIRV32_HANDLE_MEM_LOAD_CONTROL(addy, rval) rval = BusRead(addy);
+// cycle is the core's count so far, it is only stored at the end of the slice
+#define MINIRV32_OTHERCSR_WRITE(csrno, value) HandleOtherCSRWrite(image, csrno, value, cycle);
+#define MINIRV32_OTHERCSR_READ(csrno, value) value = HandleOtherCSRRead(image, csrno, cycle);
+// interrupts have the MSB set, exceptions are mcause + 1
+#define MINIRV32_TRAP(trap) { hpm_traps++; trace(TRACE_TRAP, 0, (trap & 0x80000000) ? trap : trap - 1); }
+#define MINIRV32_MRET() trace(TRACE_MRET, 0, 0);
+#ifdef CONFIG_COSTMODEL
+#define MINIRV32_INSN(ir) { cost_insn(ir); fusion_insn(ir); }
+#endif
+#ifdef CONFIG_FUSION
+#define MINIRV32_FUSION
+#define MINIRV32_FUSION_ON fusion_on
+#define MINIRV32_FUSED(ir, ir2) fusion_fused(ir, ir2);
+#endif
 
 #define MINIRV32_CUSTOM_MEMORY_BUS
 static void MINIRV32_STORE4(uint32_t ofs, uint32_t val)
@@ -75,16 +101,89 @@ static uint8_t MINIRV32_LOAD1(uint32_t ofs)
 	return val;
 }
 
+/* guest RAM shared by all harts, NULL with a single hart */
+static uint8_t *smp_ram;
+/* value loaded by the last LR.W of this hart */
+static __vm uint32_t lr_value;
+
+#define MINIRV32_CAS4(ofs, old, val) AtomicCas(ofs, old, val)
+#define MINIRV32_LR4(ofs, val) lr_value = val;
+#define MINIRV32_SC4(ofs, val) AtomicCas(ofs, lr_value, val)
+
+/*
+ * AMOs and SC.W only store if the word is unchanged since it was loaded,
+ * with other harts running that has to be one atomic operation on RAM.
+ */
+static int AtomicCas(uint32_t ofs, uint32_t old, uint32_t val)
+{
+	if (!smp_ram) {
+		MINIRV32_STORE4(ofs, val);
+		return 1;
+	}
+	return __atomic_compare_exchange_n((uint32_t *)(smp_ram + ofs), &old, val, 0,
+					   __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
 #include "mini-rv32ima.h"
 
+/*
+ * memmove() and memset() done by the host, see cache_move(). The guest
+ * writes the destination and the source, or the fill byte, then the
+ * length to CSR_HCALL_MOVE or CSR_HCALL_SET, which does the work. Reading
+ * either returns the length of the last one, 0 if it was refused because
+ * a range is outside RAM, or if the emulator doesn't have them.
+ */
+#define CSR_HCALL_DST		0x7c0
+#define CSR_HCALL_SRC		0x7c1
+#define CSR_HCALL_MOVE		0x7c2
+#define CSR_HCALL_SET		0x7c3
+
+static __vm uint32_t hcall_dst, hcall_src, hcall_done;
+static __vm uint64_t hcall_calls, hcall_bytes;
+
+static int HcallRange(uint32_t addr, uint32_t len)
+{
+	addr -= MINIRV32_RAM_IMAGE_OFFSET;
+	return addr < ram_amt && len <= ram_amt - addr;
+}
+
+static void Hcall(uint16_t csrno, uint32_t len)
+{
+	hcall_done = 0;
+	if (!HcallRange(hcall_dst, len) || (csrno == CSR_HCALL_MOVE && !HcallRange(hcall_src, len)))
+		return;
+
+	if (csrno == CSR_HCALL_MOVE)
+		cache_move(hcall_dst - MINIRV32_RAM_IMAGE_OFFSET, hcall_src - MINIRV32_RAM_IMAGE_OFFSET, len);
+	else
+		cache_set(hcall_dst - MINIRV32_RAM_IMAGE_OFFSET, hcall_src, len);
+	hcall_done = len;
+	hcall_calls++;
+	hcall_bytes += len;
+}
+
 void DumpState(struct MiniRV32IMAState *core)
 {
 	unsigned int pc = core->pc;
 	unsigned int *regs = (unsigned int *)core->regs;
 	uint64_t thit, taccessed;
+	uint64_t cleaned, clean_evictions;
+	uint64_t zero_reads, zero_marked;
+	uint64_t rom_reads, rom_copies;
 
+	uart_tx_flush();
 	cache_get_stat(&thit, &taccessed);
 	printf("hit: %llu accessed: %llu\n", thit, taccessed);
+	printf("split: %"PRIu64" accesses across two lines\n", cache_get_splits());
+	cache_get_clean(&cleaned, &clean_evictions);
+	printf("idle clean: %"PRIu64" lines written back, %"PRIu64" evictions found them clean\n",
+	       cleaned, clean_evictions);
+	cache_get_rom(&rom_reads, &rom_copies);
+	printf("rom: %"PRIu64" line reads from the image, %"PRIu64" pages of it copied to RAM\n",
+	       rom_reads, rom_copies);
+	cache_get_zero(&zero_reads, &zero_marked);
+	printf("zero: %"PRIu64" line reads without PSRAM, %"PRIu64" lines cleared by the guest\n",
+	       zero_reads, zero_marked);
 	printf("PC: %08x ", pc);
 	printf("Z:%08x ra:%08x sp:%08x gp:%08x tp:%08x t0:%08x t1:%08x t2:%08x s0:%08x s1:%08x a0:%08x a1:%08x a2:%08x a3:%08x a4:%08x a5:%08x ",
 		regs[0], regs[1], regs[2], regs[3], regs[4], regs[5], regs[6], regs[7],
@@ -92,71 +191,606 @@ void DumpState(struct MiniRV32IMAState *core)
 	printf("a6:%08x a7:%08x s2:%08x s3:%08x s4:%08x s5:%08x s6:%08x s7:%08x s8:%08x s9:%08x s10:%08x s11:%08x t3:%08x t4:%08x t5:%08x t6:%08x\n",
 		regs[16], regs[17], regs[18], regs[19], regs[20], regs[21], regs[22], regs[23],
 		regs[24], regs[25], regs[26], regs[27], regs[28], regs[29], regs[30], regs[31] );
+	if (hcall_calls)
+		printf("hcall: %"PRIu64" calls, %"PRIu64" bytes\n", hcall_calls, hcall_bytes);
+	if (zram_budget)
+		zram_report(stdout);
+	fusion_report(stdout);
+	prof_dump(stdout);
+	trace_dump();
 }
 
-struct MiniRV32IMAState core;
+__vm struct MiniRV32IMAState core;
+int dump_dt;
+/* benchmark only: on WFI jump guest time to the timer deadline instead of sleeping */
+int idle_fastforward;
+/* set by another thread to power the machine off, hart 0 does so between slices */
+volatile int poweroff_req;
 
-void app_main(void)
+// guest time runs at 1/6 of the host time
+#define TIME_DIV		6
+// upper bound of one host sleep, when no timer is armed
+#define IDLE_MAX_US		1000000
+// host time an idle hart spends writing back dirty lines, at most
+#define IDLE_CLEAN_US		100
+
+/*
+ * If not 0, guest time is derived from retired instructions instead of the
+ * host clock: mtime advances one tick every icount_ratio instructions, so
+ * runs are reproducible.
+ */
+uint32_t icount_ratio;
+
+// bounds of the number of instructions run per MiniRV32IMAStep() call
+#define SLICE_MIN		256
+#define SLICE_MAX		16384
+// guest microseconds a speed sample has to cover
+#define SLICE_SAMPLE_US		64
+// hart 0 serves the MMIO of the other harts between its slices
+#define SLICE_SMP_MAX		1024
+
+/* guest microseconds skipped by idle_fastforward */
+static __vm uint64_t idle_skip;
+static __vm uint64_t icount_us, icount_last;
+/* cycles counted while the hart waited in WFI, which retired nothing */
+static __vm uint64_t wfi_cycles;
+static __vm uint32_t icount_rem;
+/* instructions per guest microsecond, 4 fractional bits, moving average */
+static __vm uint32_t slice_ipus = 16 << 4;
+static __vm uint64_t sample_instrs, sample_us;
+/* set when a device write needs the main loop to run before the slice ends */
+static __vm int slice_break;
+
+static uint64_t GuestTime(struct MiniRV32IMAState *state)
 {
-	printf("psram init\n");
+	uint64_t cycle;
 
-	if (psram_init() < 0) {
-		printf("failed to init psram\n");
+	if (!icount_ratio)
+		return GetTimeMicroseconds() / TIME_DIV + idle_skip;
+
+	cycle = ((uint64_t)state->cycleh << 32) | state->cyclel;
+	// keep the remainder so no instruction is lost to rounding
+	icount_rem += cycle - icount_last;
+	icount_last = cycle;
+	icount_us += icount_rem / icount_ratio;
+	icount_rem %= icount_ratio;
+
+	return icount_us + idle_skip;
+}
+
+/* Account one slice worth of instructions and guest time in the speed estimate */
+static void SliceSample(uint32_t instrs, uint32_t us)
+{
+	uint32_t ipus;
+
+	sample_instrs += instrs;
+	sample_us += us;
+	if (sample_us < SLICE_SAMPLE_US)
 		return;
+
+	ipus = (sample_instrs << 4) / sample_us;
+	slice_ipus = slice_ipus - slice_ipus / 8 + ipus / 8;
+	if (!slice_ipus)
+		slice_ipus = 1;
+	sample_instrs = sample_us = 0;
+}
+
+/*
+ * Pick how many instructions to run before coming back to the main loop.
+ * Timer and external interrupts are only taken between slices, so stop
+ * around the timer deadline and poll often while the guest has input to
+ * handle, otherwise run long slices to save the per-call overhead.
+ */
+static int NextSlice(struct MiniRV32IMAState *state, uint32_t elapsedUs)
+{
+	// the core adds elapsedUs to mtime before running the slice
+	uint64_t timer = (((uint64_t)state->timerh << 32) | state->timerl) + elapsedUs;
+	uint64_t match = ((uint64_t)state->timermatchh << 32) | state->timermatchl;
+	uint64_t slice = SLICE_MAX;
+
+	if (uart_rx_pending() || (state->mip & (1 << 11)))
+		return SLICE_MIN;
+	if (nr_harts > 1 && !hart_id)
+		slice = SLICE_SMP_MAX;
+
+	if (match && match > timer) {
+		if (icount_ratio)
+			slice = (match - timer) * icount_ratio;
+		else	// leave a margin for the estimate being too high
+			slice = ((match - timer) * slice_ipus * 3 / 4) >> 4;
 	}
 
-restart:
+	if (slice < SLICE_MIN)
+		return SLICE_MIN;
+	if (slice > SLICE_MAX)
+		return SLICE_MAX;
+	return slice;
+}
 
-	if (load_images(ram_amt, NULL) < 0)
+/* Output of the PLIC context of this hart */
+static int ExternalPending(void)
+{
+	if (hart_id)
+		return __atomic_load_n(&harts[hart_id].meip, __ATOMIC_ACQUIRE);
+	return plic_irq_pending(0);
+}
+
+/*
+ * Called by the core after each MMIO store, a change of the PLIC output or
+ * of mtimecmp ends the slice, so the interrupt is not left waiting. So
+ * does zram running out, see BusRead().
+ */
+static int SliceBreak(void)
+{
+	int ret = slice_break || zram_failed || !ExternalPending() != !(core.mip & (1 << 11));
+
+	slice_break = 0;
+	return ret;
+}
+
+/*
+ * The hart is in WFI: sleep until mtime reaches mtimecmp or the host has
+ * input for us. Other interrupt sources are only raised by the guest
+ * itself or by the input, so there is nothing else to wait for. Input
+ * that is already pending did not wake the hart, so the guest polls for
+ * it from its timer and we wait for that as well.
+ */
+static void Idle(struct MiniRV32IMAState *state)
+{
+	uint64_t timer = ((uint64_t)state->timerh << 32) | state->timerl;
+	uint64_t match = ((uint64_t)state->timermatchh << 32) | state->timermatchl;
+	uint64_t delta, start, used;
+
+	if (!match) {
+		cache_clean(IDLE_CLEAN_US);
+		WaitForEvent(IDLE_MAX_US);
+		return;
+	}
+	if (match < timer)
 		return;
 
-	core.pc = MINIRV32_RAM_IMAGE_OFFSET;
-	core.regs[10] = 0x00; //hart ID
-	core.extraflags |= 3; // Machine-mode.
+	// the core fires the timer once mtime is past mtimecmp
+	delta = match - timer + 1;
+	// nothing retires during WFI, so an icount clock has to jump as well
+	if (idle_fastforward || icount_ratio) {
+		cache_clean(IDLE_CLEAN_US);
+		idle_skip += delta;
+		return;
+	}
+	if (delta > IDLE_MAX_US / TIME_DIV)
+		delta = IDLE_MAX_US / TIME_DIV;
+
+	// clean first, the sleep is cut by what that took
+	start = GetTimeMicroseconds();
+	cache_clean(delta * TIME_DIV < IDLE_CLEAN_US ? delta * TIME_DIV : IDLE_CLEAN_US);
+	used = GetTimeMicroseconds() - start;
+	if (used < delta * TIME_DIV)
+		WaitForEvent(delta * TIME_DIV - used);
+}
+
+// https://chromitem-soc.readthedocs.io/en/latest/clint.html
+#define CLINT_BASE		0x11000000
+#define CLINT_SIZE		0x10000
+#define CLINT_MSIP		0x0000
+#define CLINT_MTIMECMP		0x4000
+#define CLINT_MTIME		0xbff8
+
+#define SYSCON_BASE		0x11100000
+#define SYSCON_SIZE		0x1000
+
+/* A CLINT register of hart h changed, make that hart look at it */
+static void ClintNotify(int h)
+{
+	if (h == hart_id)
+		slice_break = 1;
+#ifdef CONFIG_SMP
+	else
+		KickHart(h);
+#endif
+}
+
+/* State of the hart whose mtimecmp is at ofs, NULL if it is not running */
+static struct MiniRV32IMAState *ClintHart(uint32_t ofs, int *h)
+{
+	*h = (ofs - CLINT_MTIMECMP) / 8;
+	if (*h >= nr_harts)
+		return NULL;
+	return harts[*h].state;
+}
+
+// Every hart has its own instance, mtime is the one of the calling hart
+static uint32_t clint_read(void *opaque, uint32_t ofs)
+{
+	struct MiniRV32IMAState *state = opaque;
+	int h;
+
+	if (ofs < CLINT_MSIP + 4 * nr_harts)
+		return __atomic_load_n(&harts[ofs / 4].msip, __ATOMIC_ACQUIRE);
+
+	switch (ofs) {
+	case CLINT_MTIME:
+		return state->timerl;
+	case CLINT_MTIME + 4:
+		return state->timerh;
+	default:
+		break;
+	}
+
+	if (ofs < CLINT_MTIMECMP || !(state = ClintHart(ofs, &h)))
+		return 0;
+	return (ofs & 4) ? state->timermatchh : state->timermatchl;
+}
+
+static uint32_t clint_write(void *opaque, uint32_t ofs, uint32_t val)
+{
+	struct MiniRV32IMAState *state;
+	int h;
+
+	if (ofs < CLINT_MSIP + 4 * nr_harts) {
+		h = ofs / 4;
+		__atomic_store_n(&harts[h].msip, val & 1, __ATOMIC_RELEASE);
+		ClintNotify(h);
+		return 0;
+	}
+
+	if (ofs < CLINT_MTIMECMP || !(state = ClintHart(ofs, &h)))
+		return 0;
+	if (ofs & 4)
+		state->timermatchh = val;
+	else
+		state->timermatchl = val;
+	ClintNotify(h);
+	return 0;
+}
+
+static void clint_dt_props(FILE *f, struct mmio_dev *dev)
+{
+	int h;
+
+	fprintf(f, "\t\t\tinterrupts-extended = <");
+	for (h = 0; h < nr_harts; h++)
+		fprintf(f, "%s0x%02x 0x03 0x%02x 0x07", h ? " " : "",
+			DT_PHANDLE_HART_INTC(h), DT_PHANDLE_HART_INTC(h));
+	fprintf(f, ">;\n");
+}
+
+// opaque is set at init, the address of core is per VM
+static __vm struct mmio_dev clint_dev = {
+	.name = "clint",
+	.compatible = "\"sifive,clint0\", \"riscv,clint0\"",
+	.base = CLINT_BASE,
+	.size = CLINT_SIZE,
+	.read = clint_read,
+	.write = clint_write,
+	.dt_props = clint_dt_props,
+};
+
+// Any write stops the core, the value is the reboot/poweroff code
+static uint32_t syscon_write(void *opaque, uint32_t ofs, uint32_t val)
+{
+	return val;
+}
+
+static void syscon_dt_props(FILE *f, struct mmio_dev *dev)
+{
+	fprintf(f, "\t\t\tphandle = <0x%02x>;\n", DT_PHANDLE_SYSCON);
+}
+
+static struct mmio_dev syscon_dev = {
+	.name = "syscon",
+	.compatible = "\"syscon\"",
+	.base = SYSCON_BASE,
+	.size = SYSCON_SIZE,
+	.write = syscon_write,
+	.dt_props = syscon_dt_props,
+};
+
+/*
+ * Devices live on hart 0's thread, the other harts only have their CLINT
+ * and hand everything else over to hart 0. Once zram has failed the guest
+ * runs on garbage until the slice ends, so it doesn't get to the devices.
+ */
+static uint32_t BusRead(uint32_t addr)
+{
+	hpm_mmio++;
+	if (zram_failed)
+		return 0;
+#ifdef CONFIG_SMP
+	if (hart_id && addr - CLINT_BASE >= CLINT_SIZE)
+		return smp_mmio(addr, 0, 0);
+#endif
+	return mmio_read(addr);
+}
+
+static uint32_t BusWrite(uint32_t addr, uint32_t val)
+{
+	hpm_mmio++;
+	if (zram_failed)
+		return 0;
+#ifdef CONFIG_SMP
+	// a poweroff or reboot is seen by hart 0, which stops everybody
+	if (hart_id && addr - CLINT_BASE >= CLINT_SIZE)
+		return smp_mmio(addr, val, 1);
+#endif
+	return mmio_write(addr, val);
+}
+
+static void DumpDT(FILE *f)
+{
+	int h;
+
+	fprintf(f, "/dts-v1/;\n\n/ {\n");
+	fprintf(f, "\t#address-cells = <0x02>;\n\t#size-cells = <0x02>;\n");
+	fprintf(f, "\tcompatible = \"riscv-minimal-nommu\";\n");
+	fprintf(f, "\tmodel = \"riscv-minimal-nommu,qemu\";\n\n");
+	fprintf(f, "\tchosen {\n\t\tbootargs = \"earlycon=uart8250,mmio,0x10000000,1000000 console=ttyS0 console=hvc0\";\n\t};\n\n");
+	fprintf(f, "\tmemory@%x {\n\t\tdevice_type = \"memory\";\n", MINIRV32_RAM_IMAGE_OFFSET);
+	fprintf(f, "\t\treg = <0x00 0x%x 0x00 0x%"PRIx32">;\n\t};\n\n", MINIRV32_RAM_IMAGE_OFFSET, ram_amt);
+	fprintf(f, "\tcpus {\n\t\t#address-cells = <0x01>;\n\t\t#size-cells = <0x00>;\n");
+	fprintf(f, "\t\ttimebase-frequency = <0xf4240>;\n");
+	for (h = 0; h < nr_harts; h++) {
+		fprintf(f, "\n\t\tcpu@%x {\n\t\t\tdevice_type = \"cpu\";\n\t\t\treg = <0x%02x>;\n", h, h);
+		fprintf(f, "\t\t\tstatus = \"okay\";\n\t\t\tcompatible = \"riscv\";\n");
+		fprintf(f, "\t\t\triscv,isa = \"rv32ima_zicntr_zihpm\";\n\t\t\tmmu-type = \"riscv,none\";\n\n");
+		fprintf(f, "\t\t\tinterrupt-controller {\n\t\t\t\t#interrupt-cells = <0x01>;\n");
+		fprintf(f, "\t\t\t\tinterrupt-controller;\n\t\t\t\tcompatible = \"riscv,cpu-intc\";\n");
+		fprintf(f, "\t\t\t\tphandle = <0x%02x>;\n\t\t\t};\n\t\t};\n", DT_PHANDLE_HART_INTC(h));
+	}
+	fprintf(f, "\t};\n\n");
+	fprintf(f, "\tsoc {\n\t\t#address-cells = <0x02>;\n\t\t#size-cells = <0x02>;\n");
+	fprintf(f, "\t\tcompatible = \"simple-bus\";\n\t\tranges;\n\n");
+	mmio_dump_dt(f);
+	fprintf(f, "\t\tpoweroff {\n\t\t\tvalue = <0x5555>;\n\t\t\toffset = <0x00>;\n");
+	fprintf(f, "\t\t\tregmap = <0x%02x>;\n\t\t\tcompatible = \"syscon-poweroff\";\n\t\t};\n\n", DT_PHANDLE_SYSCON);
+	fprintf(f, "\t\treboot {\n\t\t\tvalue = <0x7777>;\n\t\t\toffset = <0x00>;\n");
+	fprintf(f, "\t\t\tregmap = <0x%02x>;\n\t\t\tcompatible = \"syscon-reboot\";\n\t\t};\n", DT_PHANDLE_SYSCON);
+	fprintf(f, "\t};\n};\n");
+}
+
+#ifdef CONFIG_SMP
+/* secondary harts that did not leave RunHart() yet */
+static int harts_running;
+static int harts_released;
+
+/*
+ * All harts enter the kernel at the same address and it picks the first
+ * one to get there as its boot hart, hold the others back until hart 0
+ * ran its first slice so that the boot hart is always the same.
+ */
+static void ReleaseHarts(void)
+{
+	int i;
+
+	__atomic_store_n(&harts_released, 1, __ATOMIC_RELEASE);
+	for (i = 1; i < nr_harts; i++)
+		KickHart(i);
+}
+#endif
+
+/*
+ * Run this hart until the guest asks for a poweroff or reboot and return
+ * the syscon value. Only hart 0 runs the devices, the other harts return
+ * 0 once it sets smp_exit.
+ */
+static uint32_t RunHart(void)
+{
+	uint64_t lastTime = GuestTime(&core);
+	// instructions run by the previous slice, 0 if it did not run to the end
+	uint32_t retired = 0;
+	uint64_t hit, accessed, missed = 0;
 
-	// Image is loaded.
-	uint64_t lastTime = GetTimeMicroseconds();
-	int instrs_per_flip = 1024;
-	printf("RV32IMA starting\n");
 	while (1) {
-		int ret;
+		int ret, slice;
 		uint64_t *this_ccount = ((uint64_t*)&core.cyclel);
-		uint32_t elapsedUs = GetTimeMicroseconds() / 6 - lastTime;
+		uint64_t now = GuestTime(&core);
+		uint64_t cycle;
+		uint32_t elapsedUs = now - lastTime;
 
 		lastTime += elapsedUs;
-		 // Execute upto 1024 cycles before breaking out.
-		ret = MiniRV32IMAStep(&core, NULL, 0, elapsedUs, instrs_per_flip);
+		if (retired)
+			SliceSample(retired, elapsedUs);
+		if (hart_id) {
+			if (__atomic_load_n(&smp_exit, __ATOMIC_ACQUIRE))
+				return 0;
+		} else {
+			if (poweroff_req)
+				return 0x5555;
+			trace_poll();
+			uart_tx_poll(now * TIME_DIV);
+			uart_update_irq();
+			virtio_console_poll();
+			psram_poll();
+#ifdef CONFIG_SMP
+			if (nr_harts > 1) {
+				ret = smp_poll();
+				if (ret == 0x7777 || ret == 0x5555)
+					return ret;
+			}
+#endif
+		}
+		if (ExternalPending())
+			core.mip |= 1 << 11;
+		else
+			core.mip &= ~(1 << 11);
+		if (__atomic_load_n(&harts[hart_id].msip, __ATOMIC_ACQUIRE))
+			core.mip |= 1 << 3;
+		else
+			core.mip &= ~(1 << 3);
+
+		// end the slice where the profiler takes its next sample
+		slice = prof_slice(NextSlice(&core, elapsedUs));
+		cycle = *this_ccount;
+		if (prof_period) {
+			cache_get_stat(&hit, &accessed);
+			missed = accessed - hit;
+		}
+		ret = MiniRV32IMAStep(&core, NULL, 0, elapsedUs, slice);
+		retired = 0;
+		// guest RAM no longer fits, see zram.h
+		if (zram_failed)
+			return 0x5555;
+#ifdef CONFIG_SMP
+		if (nr_harts > 1 && !hart_id && !harts_released)
+			ReleaseHarts();
+#endif
 		switch (ret) {
 		case 0:
+			retired = *this_ccount - cycle;
+			if (prof_period) {
+				cache_get_stat(&hit, &accessed);
+				prof_account(retired, core.pc, core.regs[8], accessed - hit != missed);
+			}
 			break;
 		case 1:
-			MiniSleep();
-			*this_ccount += instrs_per_flip;
+			uart_tx_flush();
+			trace(TRACE_WFI_ENTER, 0, 0);
+			Idle(&core);
+			trace(TRACE_WFI_EXIT, 0, 0);
+			// with icount the cycles are guest time, which Idle() has moved on already
+			if (!icount_ratio) {
+				*this_ccount += slice;
+				wfi_cycles += slice;
+			}
 			break;
 		case 3:
 			break;
 
 		//syscon code for restart
 		case 0x7777:
-			goto restart;
-
 		//syscon code for power-off
 		case 0x5555:
-			printf("POWEROFF@0x%"PRIu32"%"PRIu32"\n", core.cycleh, core.cyclel);
-			DumpState(&core);
-			return;
+			return ret;
 		default:
 			printf("Unknown failure\n");
 			break;
 		}
 	}
+}
 
-	DumpState(&core);
+#ifdef CONFIG_SMP
+static void SecondaryHart(int hart)
+{
+	hart_id = hart;
+	harts[hart].state = &core;
+	cache_bypass(smp_ram);
+	clint_dev.opaque = &core;
+	mmio_register(&clint_dev);
+
+	// all harts enter the kernel together, it picks the boot hart itself
+	core.pc = MINIRV32_RAM_IMAGE_OFFSET;
+	core.regs[10] = hart; //hart ID
+	core.extraflags |= 3; // Machine-mode.
+	core.timerl = harts[0].state->timerl;
+	core.timerh = harts[0].state->timerh;
+
+	// wait for hart 0 to go first, see ReleaseHarts()
+	while (!__atomic_load_n(&harts_released, __ATOMIC_ACQUIRE) &&
+	       !__atomic_load_n(&smp_exit, __ATOMIC_ACQUIRE))
+		WaitForEvent(IDLE_MAX_US);
+
+	RunHart();
+	__atomic_sub_fetch(&harts_running, 1, __ATOMIC_RELEASE);
 }
 
-static void MiniSleep(void)
+static void StartHarts(void)
 {
-	usleep(10);
+	int i;
+
+	smp_ram = psram_map();
+	if (!smp_ram) {
+		printf("RAM is not directly mapped, only hart 0 runs\n");
+		return;
+	}
+	cache_bypass(smp_ram);
+
+	smp_exit = 0;
+	harts_released = 0;
+	for (i = 1; i < nr_harts; i++) {
+		memset(&harts[i], 0, sizeof(harts[i]));
+		__atomic_add_fetch(&harts_running, 1, __ATOMIC_ACQ_REL);
+		if (StartHart(SecondaryHart, i) < 0) {
+			printf("failed to start hart %d\n", i);
+			__atomic_sub_fetch(&harts_running, 1, __ATOMIC_ACQ_REL);
+		}
+	}
+}
+
+static void StopHarts(void)
+{
+	int i;
+
+	__atomic_store_n(&smp_exit, 1, __ATOMIC_RELEASE);
+	for (i = 1; i < nr_harts; i++)
+		KickHart(i);
+	while (__atomic_load_n(&harts_running, __ATOMIC_ACQUIRE))
+		sched_yield();
+	// RAM is mapped again on reboot
+	smp_ram = NULL;
+	cache_bypass(NULL);
+}
+#endif
+
+void app_main(void)
+{
+	uint32_t ret;
+	int kern_len;
+
+	if (StartKBReader() < 0)
+		printf("failed to start keyboard reader\n");
+
+	virtio_init(ram_amt);
+	prof_init(ram_amt);
+	uart_init();
+	plic_init(nr_harts);
+	virtio_blk_init();
+	virtio_console_init();
+	harts[0].state = &core;
+	clint_dev.opaque = &core;
+	mmio_register(&clint_dev);
+	mmio_register(&syscon_dev);
+
+	if (dump_dt) {
+		DumpDT(stdout);
+		return;
+	}
+
+	// with zram the board needn't have a PSRAM at all
+	if (!zram_budget)
+		printf("psram init\n");
+
+	if (!zram_budget && psram_init() < 0) {
+		printf("failed to init psram\n");
+		return;
+	}
+
+restart:
+
+	if (load_images(ram_amt, &kern_len) < 0)
+		return;
+	cache_zero_init(ram_amt, kern_len);
+
+	core.pc = MINIRV32_RAM_IMAGE_OFFSET;
+	core.regs[10] = 0x00; //hart ID
+	core.extraflags |= 3; // Machine-mode.
+
+	// Image is loaded.
+	printf("RV32IMA starting\n");
+#ifdef CONFIG_SMP
+	if (nr_harts > 1)
+		StartHarts();
+#endif
+	ret = RunHart();
+#ifdef CONFIG_SMP
+	if (nr_harts > 1)
+		StopHarts();
+#endif
+	uart_tx_flush();
+
+	if (ret == 0x7777)
+		goto restart;
+
+	printf("POWEROFF@0x%"PRIu32"%"PRIu32"\n", core.cycleh, core.cyclel);
+	DumpState(&core);
 }
 
 static uint32_t HandleException(uint32_t ir, uint32_t code)
@@ -168,30 +802,25 @@ static uint32_t HandleException(uint32_t ir, uint32_t code)
 	return code;
 }
 
-static uint32_t HandleControlStore(uint32_t addy, uint32_t val)
+/* 64 bit cycle count, cycle is the low half the core has counted to */
+static uint64_t Cycle(uint32_t cycle)
 {
-	//UART 8250 / 16550 Data Buffer
-	if (addy == 0x10000000) {
-		printf("%c", val);
-		fflush(stdout);
-	}
-	return 0;
+	return ((uint64_t)(core.cycleh + (cycle < core.cyclel)) << 32) | cycle;
 }
 
-static uint32_t HandleControlLoad(uint32_t addy)
+/* Instructions retired, the cycles counted for WFI left out */
+static uint64_t Instret(uint32_t cycle)
 {
-	// Emulating a 8250 / 16550 UART
-	if (addy == 0x10000005)
-		return 0x60 | IsKBHit();
-	else if (addy == 0x10000000 && IsKBHit())
-		return ReadKBByte();
-	return 0;
+	return Cycle(cycle) - wfi_cycles;
 }
 
-static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value)
+static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value, uint32_t cycle)
 {
 	uint32_t ptrstart, ptrend;
 
+	if (hpm_csr_write(csrno, Instret(cycle), value) == 0)
+		return;
+
 	switch (csrno) {
 	case 0x136:
 		printf("%d", (int)value);
@@ -219,17 +848,32 @@ static void HandleOtherCSRWrite(uint8_t *image, uint16_t csrno, uint32_t value)
 		putchar(value);
 		fflush(stdout);
 		break;
+	case CSR_HCALL_DST:
+		hcall_dst = value;
+		break;
+	case CSR_HCALL_SRC:
+		hcall_src = value;
+		break;
+	case CSR_HCALL_MOVE:
+	case CSR_HCALL_SET:
+		Hcall(csrno, value);
+		break;
 	default:
 		break;
 	}
 }
 
-static int32_t HandleOtherCSRRead(uint8_t *image, uint16_t csrno)
+static int32_t HandleOtherCSRRead(uint8_t *image, uint16_t csrno, uint32_t cycle)
 {
-	if (csrno == 0x140) {
-		if (!IsKBHit())
-			return -1;
-		return ReadKBByte();
-	}
+	uint32_t val;
+
+	if (hpm_csr_read(csrno, Cycle(cycle), Instret(cycle), &val) == 0)
+		return val;
+	if (csrno == CSR_HCALL_MOVE || csrno == CSR_HCALL_SET)
+		return hcall_done;
+	if (csrno == 0x140)
+		return uart_getc();
+	if (csrno == 0xf14) //mhartid
+		return hart_id;
 	return 0;
 }
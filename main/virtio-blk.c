@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "plic.h"
+#include "port.h"
+#include "virtio.h"
+#include "virtio-blk.h"
+
+#define VIRTIO_BLK_F_SEG_MAX	2
+#define VIRTIO_BLK_F_RO		5
+#define VIRTIO_BLK_F_BLK_SIZE	6
+#define VIRTIO_BLK_F_FLUSH	9
+
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_T_FLUSH	4
+#define VIRTIO_BLK_T_GET_ID	8
+
+#define VIRTIO_BLK_S_OK		0
+#define VIRTIO_BLK_S_IOERR	1
+#define VIRTIO_BLK_S_UNSUPP	2
+
+#define SECTOR_SIZE		512
+#define VIRTIO_BLK_ID_BYTES	20
+
+/* header and status take one descriptor each */
+#define VIRTIO_BLK_SEG_MAX	(VIRTQ_MAX_SIZE - 2)
+
+struct virtio_blk_config {
+	uint64_t capacity;
+	uint32_t size_max;
+	uint32_t seg_max;
+	uint16_t cylinders;
+	uint8_t heads;
+	uint8_t sectors;
+	uint32_t blk_size;
+};
+
+struct virtio_blk_req {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+static __vm struct virtio_blk_config config;
+static __vm struct virtqueue vq;
+static __vm struct virtio_dev blk;
+static __vm uint64_t nr_sectors;
+
+/* Requests are moved between the backend and guest RAM in these chunks */
+static __vm uint8_t bounce[VIRTIO_BLK_BOUNCE_SIZE];
+/* The chain being handled, too big for the stack of the MCU main task */
+static __vm struct virtq_desc descs[VIRTQ_MAX_SIZE];
+
+static int virtio_blk_xfer(uint32_t type, uint64_t sector, struct virtq_desc *d)
+{
+	uint64_t addr = d->addr;
+	uint32_t len = d->len;
+	int n, nsec;
+
+	if (len % SECTOR_SIZE)
+		return -1;
+	if (sector > nr_sectors || len / SECTOR_SIZE > nr_sectors - sector)
+		return -1;
+
+	while (len) {
+		n = len < sizeof(bounce) ? len : sizeof(bounce);
+		nsec = n / SECTOR_SIZE;
+		if (type == VIRTIO_BLK_T_IN) {
+			if (blkdev_read(sector, bounce, nsec) < 0)
+				return -1;
+			if (virtio_mem_write(addr, bounce, n) < 0)
+				return -1;
+		} else {
+			if (virtio_mem_read(addr, bounce, n) < 0)
+				return -1;
+			if (blkdev_write(sector, bounce, nsec) < 0)
+				return -1;
+		}
+		sector += nsec;
+		addr += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Handle one descriptor chain, returns the number of bytes written to it */
+static uint32_t virtio_blk_handle(uint16_t head)
+{
+	struct virtio_blk_req req;
+	uint32_t written = 0;
+	uint8_t status = VIRTIO_BLK_S_OK;
+	uint64_t sector;
+	int i, n = 0;
+
+	// Gather the whole chain first, the last descriptor is the status byte
+	do {
+		if (n == VIRTQ_MAX_SIZE || virtq_desc(&vq, head, &descs[n]) < 0)
+			return 0;
+		head = descs[n].next;
+	} while (descs[n++].flags & VIRTQ_DESC_F_NEXT);
+
+	if (n < 2 || descs[0].len < sizeof(req) ||
+	    !(descs[n - 1].flags & VIRTQ_DESC_F_WRITE) || !descs[n - 1].len)
+		return 0;
+	if (virtio_mem_read(descs[0].addr, &req, sizeof(req)) < 0)
+		return 0;
+
+	sector = req.sector;
+	switch (req.type) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		if (req.type == VIRTIO_BLK_T_OUT && (blk.features & (1ULL << VIRTIO_BLK_F_RO))) {
+			status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		for (i = 1; i < n - 1; i++) {
+			if (!!(descs[i].flags & VIRTQ_DESC_F_WRITE) != (req.type == VIRTIO_BLK_T_IN) ||
+			    virtio_blk_xfer(req.type, sector, &descs[i]) < 0) {
+				status = VIRTIO_BLK_S_IOERR;
+				break;
+			}
+			sector += descs[i].len / SECTOR_SIZE;
+			if (req.type == VIRTIO_BLK_T_IN)
+				written += descs[i].len;
+		}
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		break;
+	case VIRTIO_BLK_T_GET_ID:
+		if (n < 3 || !(descs[1].flags & VIRTQ_DESC_F_WRITE) || descs[1].len < VIRTIO_BLK_ID_BYTES) {
+			status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		memset(bounce, 0, VIRTIO_BLK_ID_BYTES);
+		strcpy((char *)bounce, "uc-rv32ima");
+		virtio_mem_write(descs[1].addr, bounce, VIRTIO_BLK_ID_BYTES);
+		written += VIRTIO_BLK_ID_BYTES;
+		break;
+	default:
+		status = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+
+	virtio_mem_write(descs[n - 1].addr, &status, 1);
+	return written + 1;
+}
+
+/* Drain every available request, then tell the guest once */
+static void virtio_blk_notify(struct virtio_dev *vdev, struct virtqueue *q)
+{
+	uint16_t head;
+	int done = 0;
+
+	while (virtq_pop(q, &head)) {
+		virtq_push(q, head, virtio_blk_handle(head));
+		done++;
+	}
+
+	if (done)
+		virtq_notify(vdev, q);
+}
+
+int virtio_blk_init(void)
+{
+	int ro;
+
+	ro = blkdev_init(&nr_sectors);
+	if (ro < 0)
+		return -1;
+
+	printf("virtio-blk: %llu sectors%s\n", (unsigned long long)nr_sectors, ro ? " (read only)" : "");
+
+	config.capacity = nr_sectors;
+	config.seg_max = VIRTIO_BLK_SEG_MAX;
+	config.blk_size = SECTOR_SIZE;
+
+	blk.device_id = VIRTIO_ID_BLOCK;
+	blk.features = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+		       (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_FLUSH);
+	if (ro)
+		blk.features |= 1ULL << VIRTIO_BLK_F_RO;
+	blk.nqueues = 1;
+	blk.vqs = &vq;
+	blk.config = &config;
+	blk.config_size = sizeof(config);
+	blk.notify = virtio_blk_notify;
+
+	return virtio_mmio_register(&blk, VIRTIO_BLK_BASE, VIRTIO_BLK_IRQ);
+}
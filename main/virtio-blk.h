@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "virtio.h"
+
+#define VIRTIO_BLK_BASE		0x10010000
+#define VIRTIO_BLK_BOUNCE_SIZE	4096
+
+/* Returns -1 if the port has no block device backend */
+int virtio_blk_init(void);
+
+#endif /* VIRTIO_BLK_H */
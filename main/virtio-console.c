@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "plic.h"
+#include "port.h"
+#include "uart.h"
+#include "virtio.h"
+#include "virtio-console.h"
+
+#define VIRTIO_CONSOLE_F_SIZE	0
+
+#define RXQ			0
+#define TXQ			1
+
+struct virtio_console_config {
+	uint16_t cols;
+	uint16_t rows;
+	uint32_t max_nr_ports;
+	uint32_t emerg_wr;
+};
+
+static __vm struct virtio_console_config config;
+static __vm struct virtqueue vqs[2];
+static __vm struct virtio_dev console;
+
+static void virtio_console_tx(struct virtqueue *vq, uint16_t head)
+{
+	struct virtq_desc desc;
+	uint8_t line[64];
+	uint64_t addr;
+	uint32_t len, n;
+
+	do {
+		if (virtq_desc(vq, head, &desc) < 0)
+			return;
+		head = desc.next;
+		if (desc.flags & VIRTQ_DESC_F_WRITE)
+			continue;
+
+		// Copy out one cacheline at a time, no bounce buffer needed
+		addr = desc.addr;
+		len = desc.len;
+		while (len) {
+			n = 64 - (addr & 0x3f);
+			if (n > len)
+				n = len;
+			if (virtio_mem_read(addr, line, n) < 0)
+				return;
+			fwrite(line, 1, n, uart_console);
+			addr += n;
+			len -= n;
+		}
+	} while (desc.flags & VIRTQ_DESC_F_NEXT);
+}
+
+static void virtio_console_notify(struct virtio_dev *vdev, struct virtqueue *vq)
+{
+	uint16_t head;
+	int done = 0;
+
+	// RX buffers are only consumed from virtio_console_poll()
+	if (vq != &vqs[TXQ])
+		return;
+
+	// Keep ordering with whatever the 8250 still has buffered
+	uart_tx_flush();
+	while (virtq_pop(vq, &head)) {
+		virtio_console_tx(vq, head);
+		virtq_push(vq, head, 0);
+		done++;
+	}
+
+	if (done) {
+		fflush(uart_console);
+		virtq_notify(vdev, vq);
+	}
+}
+
+static uint32_t virtio_console_rx(struct virtqueue *vq, uint16_t head)
+{
+	struct virtq_desc desc;
+	uint8_t buf[64];
+	uint32_t n, written = 0;
+	int c;
+
+	do {
+		if (virtq_desc(vq, head, &desc) < 0)
+			break;
+		head = desc.next;
+		if (!(desc.flags & VIRTQ_DESC_F_WRITE))
+			continue;
+
+		while (desc.len && uart_rx_pending()) {
+			for (n = 0; n < sizeof(buf) && n < desc.len && (c = uart_getc()) >= 0; n++)
+				buf[n] = c;
+			if (virtio_mem_write(desc.addr, buf, n) < 0)
+				return written;
+			desc.addr += n;
+			desc.len -= n;
+			written += n;
+		}
+	} while ((desc.flags & VIRTQ_DESC_F_NEXT) && uart_rx_pending());
+
+	return written;
+}
+
+void virtio_console_poll(void)
+{
+	struct virtqueue *vq = &vqs[RXQ];
+	uint16_t head;
+	int done = 0;
+
+	// Until the driver is up, input belongs to the 8250
+	if (!(console.status & VIRTIO_STATUS_DRIVER_OK) || !vq->ready)
+		return;
+
+	while (uart_rx_pending() && virtq_pop(vq, &head)) {
+		virtq_push(vq, head, virtio_console_rx(vq, head));
+		done++;
+	}
+
+	if (done)
+		virtq_notify(&console, vq);
+}
+
+int virtio_console_init(void)
+{
+	config.cols = 80;
+	config.rows = 25;
+	config.max_nr_ports = 1;
+
+	console.device_id = VIRTIO_ID_CONSOLE;
+	console.features = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_CONSOLE_F_SIZE);
+	console.nqueues = 2;
+	console.vqs = vqs;
+	console.config = &config;
+	console.config_size = sizeof(config);
+	console.notify = virtio_console_notify;
+
+	return virtio_mmio_register(&console, VIRTIO_CONSOLE_BASE, VIRTIO_CONSOLE_IRQ);
+}
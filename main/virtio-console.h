@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef VIRTIO_CONSOLE_H
+#define VIRTIO_CONSOLE_H
+
+#include "virtio.h"
+
+#define VIRTIO_CONSOLE_BASE	0x10020000
+
+int virtio_console_init(void);
+/* Hand pending input to the guest, called from the main loop */
+void virtio_console_poll(void);
+
+#endif /* VIRTIO_CONSOLE_H */
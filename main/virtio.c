@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cache.h"
+#include "plic.h"
+#include "port.h"
+#include "virtio.h"
+
+#define RAM_BASE		0x80000000
+
+/* virtio-mmio register layout */
+#define MMIO_MAGIC_VALUE	0x000
+#define MMIO_VERSION		0x004
+#define MMIO_DEVICE_ID		0x008
+#define MMIO_VENDOR_ID		0x00c
+#define MMIO_DEVICE_FEATURES	0x010
+#define MMIO_DEVICE_FEATURES_SEL	0x014
+#define MMIO_DRIVER_FEATURES	0x020
+#define MMIO_DRIVER_FEATURES_SEL	0x024
+#define MMIO_QUEUE_SEL		0x030
+#define MMIO_QUEUE_NUM_MAX	0x034
+#define MMIO_QUEUE_NUM		0x038
+#define MMIO_QUEUE_READY	0x044
+#define MMIO_QUEUE_NOTIFY	0x050
+#define MMIO_INTERRUPT_STATUS	0x060
+#define MMIO_INTERRUPT_ACK	0x064
+#define MMIO_STATUS		0x070
+#define MMIO_QUEUE_DESC_LOW	0x080
+#define MMIO_QUEUE_DESC_HIGH	0x084
+#define MMIO_QUEUE_AVAIL_LOW	0x090
+#define MMIO_QUEUE_AVAIL_HIGH	0x094
+#define MMIO_QUEUE_USED_LOW	0x0a0
+#define MMIO_QUEUE_USED_HIGH	0x0a4
+#define MMIO_CONFIG_GENERATION	0x0fc
+#define MMIO_CONFIG		0x100
+
+#define VIRTIO_MMIO_MAGIC	0x74726976	/* "virt" */
+#define VIRTIO_VENDOR_ID	0x554d4551	/* "QEMU", what most drivers expect */
+
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+#define VIRTIO_INT_USED_RING	1
+
+static __vm uint32_t ram_size;
+
+void virtio_init(uint32_t size)
+{
+	ram_size = size;
+}
+
+static int virtio_mem_ok(uint64_t addr, uint32_t len)
+{
+	return addr >= RAM_BASE && addr - RAM_BASE <= ram_size &&
+	       len <= ram_size - (addr - RAM_BASE);
+}
+
+int virtio_mem_read(uint64_t addr, void *buf, uint32_t len)
+{
+	if (!virtio_mem_ok(addr, len))
+		return -1;
+	cache_read_buf(addr - RAM_BASE, buf, len);
+	return 0;
+}
+
+int virtio_mem_write(uint64_t addr, void *buf, uint32_t len)
+{
+	if (!virtio_mem_ok(addr, len))
+		return -1;
+	cache_write_buf(addr - RAM_BASE, buf, len);
+	return 0;
+}
+
+/*
+ * Returns 1 and the head of the next available chain, 0 if there is none.
+ * A head out of range is returned as well, virtq_desc() refuses it and
+ * the caller hands it back empty, so the chains behind it still run.
+ */
+int virtq_pop(struct virtqueue *vq, uint16_t *head)
+{
+	uint16_t idx;
+
+	if (!vq->ready || virtio_mem_read(vq->avail + 2, &idx, 2) < 0)
+		return 0;
+	if (idx == vq->last_avail)
+		return 0;
+
+	if (virtio_mem_read(vq->avail + 4 + 2 * (vq->last_avail % vq->num), head, 2) < 0)
+		return 0;
+	vq->last_avail++;
+
+	return 1;
+}
+
+int virtq_desc(struct virtqueue *vq, uint16_t idx, struct virtq_desc *desc)
+{
+	if (idx >= vq->num)
+		return -1;
+	return virtio_mem_read(vq->desc + 16 * idx, desc, sizeof(*desc));
+}
+
+/* Put a used element, the guest only sees it after virtq_notify() */
+void virtq_push(struct virtqueue *vq, uint16_t head, uint32_t len)
+{
+	uint32_t elem[2] = { head, len };
+
+	virtio_mem_write(vq->used + 4 + 8 * (vq->used_idx % vq->num), elem, sizeof(elem));
+	vq->used_idx++;
+}
+
+void virtq_notify(struct virtio_dev *vdev, struct virtqueue *vq)
+{
+	uint16_t flags;
+
+	virtio_mem_write(vq->used + 2, &vq->used_idx, 2);
+
+	if (virtio_mem_read(vq->avail, &flags, 2) < 0 || (flags & VRING_AVAIL_F_NO_INTERRUPT))
+		return;
+
+	vdev->isr |= VIRTIO_INT_USED_RING;
+	plic_set_irq(vdev->mmio.irq, 1);
+}
+
+static void virtio_reset(struct virtio_dev *vdev)
+{
+	int i;
+
+	vdev->status = 0;
+	vdev->isr = 0;
+	vdev->drv_features = 0;
+	vdev->queue_sel = 0;
+	for (i = 0; i < vdev->nqueues; i++)
+		memset(&vdev->vqs[i], 0, sizeof(vdev->vqs[i]));
+	plic_set_irq(vdev->mmio.irq, 0);
+
+	if (vdev->reset)
+		vdev->reset(vdev);
+}
+
+static struct virtqueue *virtio_cur_vq(struct virtio_dev *vdev)
+{
+	if (vdev->queue_sel >= vdev->nqueues)
+		return NULL;
+	return &vdev->vqs[vdev->queue_sel];
+}
+
+static uint32_t virtio_mmio_read(void *opaque, uint32_t ofs)
+{
+	struct virtio_dev *vdev = opaque;
+	struct virtqueue *vq = virtio_cur_vq(vdev);
+	uint32_t val = 0;
+
+	if (ofs >= MMIO_CONFIG) {
+		ofs -= MMIO_CONFIG;
+		if (ofs < vdev->config_size)
+			memcpy(&val, (uint8_t *)vdev->config + ofs,
+			       vdev->config_size - ofs < 4 ? vdev->config_size - ofs : 4);
+		return val;
+	}
+
+	switch (ofs) {
+	case MMIO_MAGIC_VALUE:
+		return VIRTIO_MMIO_MAGIC;
+	case MMIO_VERSION:
+		return 2;
+	case MMIO_DEVICE_ID:
+		return vdev->device_id;
+	case MMIO_VENDOR_ID:
+		return VIRTIO_VENDOR_ID;
+	case MMIO_DEVICE_FEATURES:
+		if (vdev->dev_features_sel > 1)
+			return 0;
+		return vdev->features >> (32 * vdev->dev_features_sel);
+	case MMIO_QUEUE_NUM_MAX:
+		return vq ? VIRTQ_MAX_SIZE : 0;
+	case MMIO_QUEUE_READY:
+		return vq ? vq->ready : 0;
+	case MMIO_INTERRUPT_STATUS:
+		return vdev->isr;
+	case MMIO_STATUS:
+		return vdev->status;
+	case MMIO_CONFIG_GENERATION:
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t virtio_mmio_write(void *opaque, uint32_t ofs, uint32_t val)
+{
+	struct virtio_dev *vdev = opaque;
+	struct virtqueue *vq = virtio_cur_vq(vdev);
+
+	if (ofs >= MMIO_CONFIG)
+		return 0;
+
+	switch (ofs) {
+	case MMIO_DEVICE_FEATURES_SEL:
+		vdev->dev_features_sel = val;
+		break;
+	case MMIO_DRIVER_FEATURES:
+		if (vdev->drv_features_sel == 0)
+			vdev->drv_features = (vdev->drv_features & ~0xffffffffULL) | val;
+		else if (vdev->drv_features_sel == 1)
+			vdev->drv_features = (vdev->drv_features & 0xffffffffULL) | ((uint64_t)val << 32);
+		vdev->drv_features &= vdev->features;
+		break;
+	case MMIO_DRIVER_FEATURES_SEL:
+		vdev->drv_features_sel = val;
+		break;
+	case MMIO_QUEUE_SEL:
+		vdev->queue_sel = val;
+		break;
+	case MMIO_QUEUE_NUM:
+		// split rings need a power of two size
+		if (vq && val && val <= VIRTQ_MAX_SIZE && !(val & (val - 1)))
+			vq->num = val;
+		break;
+	case MMIO_QUEUE_READY:
+		if (vq) {
+			vq->ready = val & 1;
+			if (vq->ready && !vq->num)
+				vq->num = VIRTQ_MAX_SIZE;
+		}
+		break;
+	case MMIO_QUEUE_NOTIFY:
+		if (val < vdev->nqueues && (vdev->status & VIRTIO_STATUS_DRIVER_OK) &&
+		    vdev->vqs[val].ready && vdev->notify)
+			vdev->notify(vdev, &vdev->vqs[val]);
+		break;
+	case MMIO_INTERRUPT_ACK:
+		vdev->isr &= ~val;
+		if (!vdev->isr)
+			plic_set_irq(vdev->mmio.irq, 0);
+		break;
+	case MMIO_STATUS:
+		if (val == 0)
+			virtio_reset(vdev);
+		else
+			vdev->status = val;
+		break;
+	case MMIO_QUEUE_DESC_LOW:
+		if (vq)
+			vq->desc = (vq->desc & ~0xffffffffULL) | val;
+		break;
+	case MMIO_QUEUE_DESC_HIGH:
+		if (vq)
+			vq->desc = (vq->desc & 0xffffffffULL) | ((uint64_t)val << 32);
+		break;
+	case MMIO_QUEUE_AVAIL_LOW:
+		if (vq)
+			vq->avail = (vq->avail & ~0xffffffffULL) | val;
+		break;
+	case MMIO_QUEUE_AVAIL_HIGH:
+		if (vq)
+			vq->avail = (vq->avail & 0xffffffffULL) | ((uint64_t)val << 32);
+		break;
+	case MMIO_QUEUE_USED_LOW:
+		if (vq)
+			vq->used = (vq->used & ~0xffffffffULL) | val;
+		break;
+	case MMIO_QUEUE_USED_HIGH:
+		if (vq)
+			vq->used = (vq->used & 0xffffffffULL) | ((uint64_t)val << 32);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+int virtio_mmio_register(struct virtio_dev *vdev, uint32_t base, int irq)
+{
+	vdev->mmio.name = "virtio";
+	vdev->mmio.compatible = "\"virtio,mmio\"";
+	vdev->mmio.base = base;
+	vdev->mmio.size = VIRTIO_MMIO_SIZE;
+	vdev->mmio.irq = irq;
+	vdev->mmio.opaque = vdev;
+	vdev->mmio.read = virtio_mmio_read;
+	vdev->mmio.write = virtio_mmio_write;
+
+	return mmio_register(&vdev->mmio);
+}
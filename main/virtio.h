@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+
+#include "mmio.h"
+
+/* virtio-mmio (version 2) transport */
+#define VIRTIO_MMIO_SIZE		0x1000
+
+#define VIRTIO_ID_BLOCK			2
+#define VIRTIO_ID_CONSOLE		3
+
+#define VIRTIO_F_VERSION_1		32
+
+#define VIRTIO_STATUS_DRIVER_OK		4
+
+#define VIRTQ_DESC_F_NEXT		1
+#define VIRTQ_DESC_F_WRITE		2
+
+#define VIRTQ_MAX_SIZE			64
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct virtqueue {
+	uint32_t num;
+	uint32_t ready;
+	uint64_t desc;
+	uint64_t avail;
+	uint64_t used;
+	uint16_t last_avail;
+	uint16_t used_idx;
+};
+
+struct virtio_dev {
+	struct mmio_dev mmio;
+	uint32_t device_id;
+	uint64_t features;
+	int nqueues;
+	struct virtqueue *vqs;
+	/* device specific config space, little endian */
+	void *config;
+	uint32_t config_size;
+	void (*notify)(struct virtio_dev *vdev, struct virtqueue *vq);
+	void (*reset)(struct virtio_dev *vdev);
+
+	/* transport registers */
+	uint32_t status;
+	uint32_t isr;
+	uint32_t dev_features_sel;
+	uint32_t drv_features_sel;
+	uint32_t queue_sel;
+	uint64_t drv_features;
+};
+
+void virtio_init(uint32_t ram_size);
+int virtio_mmio_register(struct virtio_dev *vdev, uint32_t base, int irq);
+
+/* guest physical memory, return -1 if the range is outside RAM */
+int virtio_mem_read(uint64_t addr, void *buf, uint32_t len);
+int virtio_mem_write(uint64_t addr, void *buf, uint32_t len);
+
+int virtq_pop(struct virtqueue *vq, uint16_t *head);
+int virtq_desc(struct virtqueue *vq, uint16_t idx, struct virtq_desc *desc);
+void virtq_push(struct virtqueue *vq, uint16_t head, uint32_t len);
+void virtq_notify(struct virtio_dev *vdev, struct virtqueue *vq);
+
+#endif /* VIRTIO_H */
@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zram.h"
+
+enum {
+	ZRAM_FILL,	/* every word is fill */
+	ZRAM_LZ,	/* data holds len bytes of LZ sequences */
+	ZRAM_RAW,	/* data holds the page as it is */
+};
+
+struct zram_page {
+	union {
+		uint8_t *data;
+		uint32_t fill;
+	};
+	uint16_t len;
+	uint8_t kind;
+};
+
+struct zram_slot {
+	uint32_t page;
+	/* when it was used last, the oldest slot is the next to go */
+	uint32_t stamp;
+	int valid, dirty;
+	uint8_t data[ZRAM_PAGE_SIZE];
+};
+
+/* a page has to shrink to this to be kept compressed */
+#define ZRAM_LZ_MAX		(ZRAM_PAGE_SIZE * 3 / 4)
+
+#define LZ_HASH_BITS		10
+#define LZ_MIN_MATCH		4
+
+uint32_t zram_budget = ZRAM_BUDGET;
+
+static __vm struct zram_page *pages;
+static __vm uint32_t nr_pages;
+static __vm struct zram_slot slots[ZRAM_SLOTS];
+static __vm uint32_t slot_clock;
+static __vm uint16_t lz_hash[1 << LZ_HASH_BITS];
+static __vm uint8_t lz_buf[ZRAM_LZ_MAX];
+/* host memory taken by the pages, now and at most */
+static __vm uint32_t used, used_max;
+static __vm uint64_t loads, stores, refused;
+/* where accesses go once no slot can be freed, see zram_slot() */
+static __vm struct zram_slot spare;
+__vm int zram_failed;
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+/* A length of 15 or more goes on in bytes of up to 255 */
+static int lz_put_len(uint8_t *dst, int op, int cap, uint32_t n)
+{
+	for (n -= 15; ; n -= 255) {
+		if (op >= cap)
+			return -1;
+		dst[op++] = n < 255 ? n : 255;
+		if (n < 255)
+			return op;
+	}
+}
+
+/*
+ * One sequence: a token with the literal count in the high nibble and the
+ * match length - 4 in the low one, the literals, then the 16 bit offset
+ * of the match. The last sequence of a page has no match.
+ */
+static int lz_emit(uint8_t *dst, int op, int cap, const uint8_t *lit, uint32_t nlit,
+		   uint32_t off, uint32_t mlen)
+{
+	uint32_t m = mlen ? mlen - LZ_MIN_MATCH : 0;
+	int tok = op++;
+
+	if (tok >= cap)
+		return -1;
+	dst[tok] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15 && (op = lz_put_len(dst, op, cap, nlit)) < 0)
+		return -1;
+	if (op + nlit > cap)
+		return -1;
+	memcpy(dst + op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+
+	if (op + 2 > cap)
+		return -1;
+	dst[op++] = off;
+	dst[op++] = off >> 8;
+	if (m >= 15)
+		op = lz_put_len(dst, op, cap, m);
+	return op;
+}
+
+/* Compress a page into at most cap bytes of dst, returns the length or -1 */
+static int lz_compress(const uint8_t *src, uint8_t *dst, int cap)
+{
+	uint32_t ip = 0, anchor = 0, ref, h, m;
+	int op = 0;
+
+	memset(lz_hash, 0, sizeof(lz_hash));
+	while (ip + LZ_MIN_MATCH <= ZRAM_PAGE_SIZE) {
+		h = (load32(src + ip) * 2654435761u) >> (32 - LZ_HASH_BITS);
+		ref = lz_hash[h];
+		lz_hash[h] = ip;
+		if (ref >= ip || load32(src + ref) != load32(src + ip)) {
+			ip++;
+			continue;
+		}
+
+		for (m = LZ_MIN_MATCH; ip + m < ZRAM_PAGE_SIZE && src[ref + m] == src[ip + m]; m++)
+			;
+		op = lz_emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, m);
+		if (op < 0)
+			return -1;
+		ip += m;
+		anchor = ip;
+	}
+
+	return lz_emit(dst, op, cap, src + anchor, ZRAM_PAGE_SIZE - anchor, 0, 0);
+}
+
+static int lz_get_len(const uint8_t *src, uint32_t *ip, uint32_t len, uint32_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= len)
+			return -1;
+		b = src[(*ip)++];
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+static int lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+	uint32_t ip = 0, op = 0, n, off, i;
+	uint8_t tok;
+
+	while (ip < len) {
+		tok = src[ip++];
+		n = tok >> 4;
+		if (n == 15 && lz_get_len(src, &ip, len, &n) < 0)
+			return -1;
+		if (ip + n > len || op + n > ZRAM_PAGE_SIZE)
+			return -1;
+		memcpy(dst + op, src + ip, n);
+		ip += n;
+		op += n;
+		if (ip == len)
+			break;
+
+		if (ip + 2 > len)
+			return -1;
+		off = src[ip] | src[ip + 1] << 8;
+		ip += 2;
+		n = tok & 15;
+		if (n == 15 && lz_get_len(src, &ip, len, &n) < 0)
+			return -1;
+		n += LZ_MIN_MATCH;
+		if (!off || off > op || op + n > ZRAM_PAGE_SIZE)
+			return -1;
+		if (off >= n) {
+			memcpy(dst + op, dst + op - off, n);
+			op += n;
+			continue;
+		}
+		// byte by byte, the match overlaps what it produces
+		for (i = 0; i < n; i++, op++)
+			dst[op] = dst[op - off];
+	}
+
+	return op == ZRAM_PAGE_SIZE ? 0 : -1;
+}
+
+static void zram_free(struct zram_page *pg)
+{
+	if (pg->kind != ZRAM_FILL) {
+		used -= pg->len;
+		free(pg->data);
+	}
+	pg->kind = ZRAM_FILL;
+	pg->fill = 0;
+}
+
+/* Compress the slot back into its page, -1 if that is over the budget */
+static int zram_store(struct zram_slot *s)
+{
+	struct zram_page *pg = &pages[s->page];
+	const uint8_t *src = s->data;
+	uint32_t i, fill = load32(src);
+	int len, kind = ZRAM_RAW;
+	uint8_t *data;
+
+	stores++;
+	for (i = 4; i < ZRAM_PAGE_SIZE && load32(src + i) == fill; i += 4)
+		;
+	if (i == ZRAM_PAGE_SIZE) {
+		zram_free(pg);
+		pg->fill = fill;
+		return 0;
+	}
+
+	len = lz_compress(src, lz_buf, ZRAM_LZ_MAX);
+	if (len > 0) {
+		kind = ZRAM_LZ;
+		src = lz_buf;
+	} else {
+		len = ZRAM_PAGE_SIZE;
+	}
+
+	if (used - (pg->kind == ZRAM_FILL ? 0 : pg->len) + len > zram_budget ||
+	    !(data = malloc(len))) {
+		if (!refused++)
+			printf("zram: out of memory, page 0x%"PRIx32" stays in its slot\n",
+			       s->page << ZRAM_PAGE_SHIFT);
+		return -1;
+	}
+	memcpy(data, src, len);
+	zram_free(pg);
+	pg->data = data;
+	pg->len = len;
+	pg->kind = kind;
+	used += len;
+	if (used > used_max)
+		used_max = used;
+	return 0;
+}
+
+static void zram_fill(uint8_t *dst, uint32_t fill, uint32_t ofs, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = fill >> ((ofs + i) & 3) * 8;
+}
+
+static struct zram_slot *zram_oldest(void)
+{
+	struct zram_slot *s = &slots[0];
+	int i;
+
+	for (i = 1; i < ZRAM_SLOTS; i++) {
+		if (slots[i].stamp < s->stamp)
+			s = &slots[i];
+	}
+	return s;
+}
+
+/*
+ * The slot to load a page into: the least recently used one that is clean
+ * or can be stored. A page that doesn't fit in the budget stays in its
+ * slot, as the newest, rather than being dropped. With every slot taken
+ * like that the machine can't go on: zram_failed is set for the core to
+ * stop it. The accesses until then go to a spare slot, which leaves RAM
+ * as it was, and MMIO is refused, so no garbage reaches a device.
+ */
+static struct zram_slot *zram_victim(void)
+{
+	struct zram_slot *s;
+	int i;
+
+	for (i = 0; i < ZRAM_SLOTS; i++) {
+		s = zram_oldest();
+		if (!s->valid || !s->dirty || zram_store(s) == 0)
+			return s;
+		s->stamp = ++slot_clock;
+	}
+
+	if (!zram_failed)
+		printf("zram: out of memory with all %d slots kept, stopping\n", ZRAM_SLOTS);
+	zram_failed = 1;
+	return NULL;
+}
+
+/* The slot holding page, loaded into the least recently used one if none does */
+static struct zram_slot *zram_slot(uint32_t page)
+{
+	struct zram_page *pg = &pages[page];
+	struct zram_slot *s;
+	int i;
+
+	for (i = 0; i < ZRAM_SLOTS; i++) {
+		if (slots[i].valid && slots[i].page == page) {
+			s = &slots[i];
+			goto out;
+		}
+	}
+
+	s = zram_victim();
+	if (!s)
+		return &spare;
+
+	loads++;
+	s->page = page;
+	s->valid = 1;
+	s->dirty = 0;
+	if (pg->kind == ZRAM_FILL)
+		zram_fill(s->data, pg->fill, 0, ZRAM_PAGE_SIZE);
+	else if (pg->kind == ZRAM_RAW)
+		memcpy(s->data, pg->data, ZRAM_PAGE_SIZE);
+	else if (lz_decompress(pg->data, pg->len, s->data) < 0)
+		printf("zram: page 0x%"PRIx32" is corrupted\n", page << ZRAM_PAGE_SHIFT);
+out:
+	s->stamp = ++slot_clock;
+	return s;
+}
+
+void zram_read(uint32_t addr, void *buf, uint32_t len)
+{
+	uint32_t page, ofs, n, i;
+	uint8_t *p = buf;
+
+	for (; len; addr += n, p += n, len -= n) {
+		page = addr >> ZRAM_PAGE_SHIFT;
+		ofs = addr & (ZRAM_PAGE_SIZE - 1);
+		n = ZRAM_PAGE_SIZE - ofs;
+		if (n > len)
+			n = len;
+		if (page >= nr_pages) {
+			memset(p, 0, n);
+			continue;
+		}
+
+		// a filled page that isn't in a slot needs no decompression
+		for (i = 0; i < ZRAM_SLOTS; i++) {
+			if (slots[i].valid && slots[i].page == page)
+				break;
+		}
+		if (i == ZRAM_SLOTS && pages[page].kind == ZRAM_FILL)
+			zram_fill(p, pages[page].fill, ofs, n);
+		else
+			memcpy(p, zram_slot(page)->data + ofs, n);
+	}
+}
+
+void zram_write(uint32_t addr, const void *buf, uint32_t len)
+{
+	const uint8_t *p = buf;
+	struct zram_slot *s;
+	uint32_t page, ofs, n;
+
+	for (; len; addr += n, p += n, len -= n) {
+		page = addr >> ZRAM_PAGE_SHIFT;
+		ofs = addr & (ZRAM_PAGE_SIZE - 1);
+		n = ZRAM_PAGE_SIZE - ofs;
+		if (n > len)
+			n = len;
+		if (page >= nr_pages)
+			continue;
+
+		s = zram_slot(page);
+		memcpy(s->data + ofs, p, n);
+		s->dirty = 1;
+	}
+}
+
+int zram_load(uint32_t ram_size, const void *image, uint32_t len)
+{
+	uint32_t i;
+
+	if (pages) {
+		for (i = 0; i < nr_pages; i++)
+			zram_free(&pages[i]);
+	} else {
+		pages = calloc(ram_size >> ZRAM_PAGE_SHIFT, sizeof(*pages));
+		if (!pages) {
+			printf("zram: no memory for the page table\n");
+			return -1;
+		}
+		nr_pages = ram_size >> ZRAM_PAGE_SHIFT;
+	}
+	memset(slots, 0, sizeof(slots));
+	slot_clock = 0;
+	refused = 0;
+	zram_failed = 0;
+
+	// what doesn't fit stays in the slots, dirty
+	zram_write(0, image, len);
+	for (i = 0; i < ZRAM_SLOTS; i++) {
+		if (slots[i].valid && slots[i].dirty && zram_store(&slots[i]) == 0)
+			slots[i].dirty = 0;
+	}
+	if (zram_failed)
+		return -1;
+
+	printf("zram: %"PRIu32" byte image in %"PRIu32" bytes\n", len, used);
+	return 0;
+}
+
+void zram_report(FILE *f)
+{
+	uint32_t i, fill = 0, zero = 0, lz = 0, raw = 0;
+	uint64_t ram = (uint64_t)nr_pages << ZRAM_PAGE_SHIFT;
+
+	if (!pages)
+		return;
+
+	for (i = 0; i < nr_pages; i++) {
+		if (pages[i].kind == ZRAM_LZ)
+			lz++;
+		else if (pages[i].kind == ZRAM_RAW)
+			raw++;
+		else if (pages[i].fill)
+			fill++;
+		else
+			zero++;
+	}
+	fprintf(f, "zram: %"PRIu32" pages: %"PRIu32" zero, %"PRIu32" filled, %"PRIu32" lz, %"PRIu32" raw\n",
+		nr_pages, zero, fill, lz, raw);
+	fprintf(f, "zram: %"PRIu32" bytes used, %"PRIu32" at most, budget %"PRIu32", ratio %.1f:1 (%.1f:1 without zero pages)\n",
+		used, used_max, zram_budget, used ? (double)ram / used : 0.0,
+		used ? (double)(ram - ((uint64_t)zero << ZRAM_PAGE_SHIFT)) / used : 0.0);
+	fprintf(f, "zram: %"PRIu64" page loads, %"PRIu64" stores, %"PRIu64" refused\n", loads, stores, refused);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "port.h"
+
+#define ZRAM_PAGE_SHIFT		12
+#define ZRAM_PAGE_SIZE		(1 << ZRAM_PAGE_SHIFT)
+/* pages kept decompressed behind the cache lines, ZRAM_PAGE_SIZE bytes each */
+#ifndef ZRAM_SLOTS
+#define ZRAM_SLOTS		4
+#endif
+
+/*
+ * Guest RAM kept compressed in host memory instead of PSRAM, for boards
+ * without one. Pages filled with one 32 bit pattern, zero included, take
+ * no memory at all, the others are LZ compressed, or stored as they are
+ * if that doesn't win a quarter. zram_budget is the most host memory the
+ * compressed pages may take, 0 means RAM is in PSRAM as usual.
+ */
+extern uint32_t zram_budget;
+/*
+ * A page that doesn't fit in the budget is kept decompressed in its slot.
+ * Once all the slots are kept like that RAM can't be held any more, this
+ * is set and the machine has to stop.
+ */
+extern __vm int zram_failed;
+
+/* the MCU ports have no command line, build with -DZRAM_BUDGET=bytes there */
+#ifndef ZRAM_BUDGET
+#define ZRAM_BUDGET		0
+#endif
+
+/* Start over with ram_size bytes of RAM holding the len bytes of image */
+int zram_load(uint32_t ram_size, const void *image, uint32_t len);
+/* The psram_read() and psram_write() of zram */
+void zram_read(uint32_t addr, void *buf, uint32_t len);
+void zram_write(uint32_t addr, const void *buf, uint32_t len);
+void zram_report(FILE *f);
+
+#endif /* ZRAM_H */
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Host time of cache_read() and cache_write() per access, with the stub
+ * PSRAM: alternating 4 byte loads and stores over a working set that fits
+ * in the cache and one that doesn't, aligned and across lines. Best of
+ * RUNS, "make bench" runs it.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cache.h"
+#include "stubs.h"
+
+#define RAM_SIZE	(1 << 20)
+#define ACCESSES	50000000
+#define RUNS		7
+
+static double Now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the best ns per access, words at a stride of 28 bytes from ofs */
+static double Run(uint32_t span, uint32_t ofs, uint32_t *sum)
+{
+	double best = 1e9, t;
+	uint32_t i, a, v;
+	int r;
+
+	for (r = 0; r < RUNS; r++) {
+		t = Now();
+		for (i = 0; i < ACCESSES; i++) {
+			a = ((i * 28) & (span - 1)) + ofs;
+			if (i & 1) {
+				cache_read(a, &v, 4);
+				*sum += v;
+			} else {
+				cache_write(a, &i, 4);
+			}
+		}
+		t = Now() - t;
+		if (t < best)
+			best = t;
+	}
+	return best * 1e9 / ACCESSES;
+}
+
+int main(void)
+{
+	static const uint32_t spans[] = { 2048, 65536 };
+	uint32_t sum = 0;
+	unsigned int i;
+
+	stub_ram_init(RAM_SIZE, 0);
+	for (i = 0; i < sizeof(spans) / sizeof(spans[0]); i++) {
+		printf("%6u bytes: aligned %.2f ns", spans[i], Run(spans[i], 0, &sum));
+		// 28 is a multiple of 4, at 62 every 16th access crosses a line
+		printf(", at +62 %.2f ns per access\n", Run(spans[i], 62, &sum));
+	}
+	printf("cache-bench: %llu split accesses (%08x)\n", (unsigned long long)cache_get_splits(), sum);
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Misaligned loads and stores of 1, 2 and 4 bytes, half of them across a
+ * cache line, against a flat copy of RAM. First the four ways a split
+ * access can find its two lines, then random ones. At the end every dirty
+ * line is written back and RAM itself has to match as well.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "psram.h"
+#include "stubs.h"
+
+#define RAM_SIZE	(64 * 1024)
+#define ITERATIONS	200000
+/* lines this far apart share a set, three of them can't all be cached */
+#define SET_STRIDE	2048
+
+static uint8_t ref[RAM_SIZE];
+static int failures;
+
+static void Store(uint32_t ofs, uint32_t val, int size)
+{
+	cache_write(ofs, &val, size);
+	memcpy(ref + ofs, &val, size);
+}
+
+static void Load(uint32_t ofs, int size)
+{
+	uint32_t val = 0, want = 0;
+
+	cache_read(ofs, &val, size);
+	memcpy(&want, ref + ofs, size);
+	if (val != want && failures++ < 10)
+		printf("load of %d bytes at %05x: %08x, not %08x\n", size, ofs, val, want);
+}
+
+/* Have the line at ofs cached or not */
+static void Touch(uint32_t ofs)
+{
+	Load(ofs & ~0x3f, 1);
+}
+
+static void Evict(uint32_t ofs)
+{
+	Touch((ofs + SET_STRIDE) % RAM_SIZE);
+	Touch((ofs + 2 * SET_STRIDE) % RAM_SIZE);
+}
+
+/* Both lines hit, the first or the second one only, or neither */
+static void Halves(void)
+{
+	uint32_t line = 0x1000, ofs, size;
+	int way;
+
+	for (way = 0; way < 4; way++) {
+		for (size = 2; size <= 4; size += 2) {
+			for (ofs = line + 64 - size + 1; ofs < line + 64; ofs++) {
+				if (way & 1)
+					Touch(line);
+				else
+					Evict(line);
+				if (way & 2)
+					Touch(line + 64);
+				else
+					Evict(line + 64);
+				Store(ofs, rand(), size);
+
+				if (way & 1)
+					Evict(line);
+				if (way & 2)
+					Evict(line + 64);
+				Load(ofs, size);
+			}
+		}
+		line += 128;
+	}
+}
+
+int main(void)
+{
+	static const int sizes[] = { 1, 2, 4 };
+	uint32_t ofs, i, size;
+	uint64_t splits;
+
+	stub_ram_init(RAM_SIZE, 1);
+	memcpy(ref, stub_ram, RAM_SIZE);
+
+	Halves();
+	splits = cache_get_splits();
+	if (!splits) {
+		printf("no access was split\n");
+		failures++;
+	}
+
+	srand(2);
+	for (i = 0; i < ITERATIONS; i++) {
+		size = sizes[rand() % 3];
+		ofs = rand() % (RAM_SIZE - 64);
+		// every other one right before the end of a line
+		if (i & 1)
+			ofs = (ofs | 0x3f) - rand() % size;
+		if (rand() % 2)
+			Store(ofs, rand(), size);
+		else
+			Load(ofs, size);
+	}
+
+	cache_clean(-1);
+	psram_sync();
+	for (ofs = 0; ofs < RAM_SIZE; ofs++) {
+		if (stub_ram[ofs] != ref[ofs] && failures++ < 20)
+			printf("RAM at %05x: %02x, not %02x\n", ofs, stub_ram[ofs], ref[ofs]);
+	}
+
+	printf("cache-split: %llu split accesses, %d failures\n",
+	       (unsigned long long)cache_get_splits(), failures);
+	return failures != 0;
+}
@@ -0,0 +1,2 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/* tools/linux/uc-string.S uses nothing of the kernel's asm.h */
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * What tools/linux/uc-string.S needs of the kernel's linkage.h. Nothing
+ * is global, so that the assembler resolves every call in the test image
+ * and no linker is needed.
+ */
+
+#define SYM_FUNC_START(name)		.type name, @function; name:
+#define SYM_FUNC_END(name)		.size name, . - name
+#define SYM_FUNC_ALIAS(alias, name)	.set alias, name
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "port.h"
+#include "psram.h"
+#include "stubs.h"
+#include "trace.h"
+
+uint8_t *stub_ram;
+uint32_t stub_ram_size;
+int trace_on;
+
+/* requests in flight, oldest first */
+static struct psram_req *head, **tail = &head;
+
+void stub_ram_init(uint32_t size, unsigned int seed)
+{
+	uint32_t i;
+
+	psram_sync();
+	free(stub_ram);
+	stub_ram = calloc(size, 1);
+	if (!stub_ram) {
+		perror("stub_ram");
+		exit(1);
+	}
+	stub_ram_size = size;
+	srand(seed);
+	for (i = 0; seed && i < size; i++)
+		stub_ram[i] = rand();
+}
+
+static int Xfer(uint32_t addr, void *buf, int len, int write)
+{
+	if (addr > stub_ram_size || len > stub_ram_size - addr) {
+		printf("psram: %s of %d bytes at %08x is out of RAM\n", write ? "write" : "read", len, addr);
+		exit(1);
+	}
+	if (write)
+		memcpy(stub_ram + addr, buf, len);
+	else
+		memcpy(buf, stub_ram + addr, len);
+	return len;
+}
+
+static void Complete(void)
+{
+	struct psram_req *req = head;
+
+	head = req->next;
+	if (!head)
+		tail = &head;
+	req->ret = Xfer(req->addr, req->buf, req->len, req->write);
+	req->pending = 0;
+	if (req->done)
+		req->done(req);
+}
+
+int psram_read(uint32_t addr, void *buf, int len)
+{
+	psram_sync();
+	return Xfer(addr, buf, len, 0);
+}
+
+int psram_write(uint32_t addr, void *buf, int len)
+{
+	psram_sync();
+	return Xfer(addr, buf, len, 1);
+}
+
+void *psram_map(void)
+{
+	return NULL;
+}
+
+int psram_submit(struct psram_req *req)
+{
+	req->pending = 1;
+	req->next = NULL;
+	*tail = req;
+	tail = &req->next;
+	return 0;
+}
+
+int psram_poll(void)
+{
+	return 0;
+}
+
+void psram_wait(struct psram_req *req)
+{
+	while (req->pending)
+		Complete();
+}
+
+void psram_sync(void)
+{
+	while (head)
+		Complete();
+}
+
+uint64_t GetTimeMicroseconds()
+{
+	return 0;
+}
+
+void trace_emit(int type, int id, uint32_t arg)
+{
+}
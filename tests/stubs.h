@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef STUBS_H
+#define STUBS_H
+
+#include <stdint.h>
+
+/*
+ * What cache.c and zram.c need of a port, to run them on the host: PSRAM
+ * is stub_ram, stub_ram_size bytes, and a submitted request is only done
+ * when something waits for it, like on the chips.
+ */
+extern uint8_t *stub_ram;
+extern uint32_t stub_ram_size;
+
+/* A fresh stub_ram of size bytes, filled with seed's pattern, 0 for zeros */
+void stub_ram_init(uint32_t size, unsigned int seed);
+
+#endif /* STUBS_H */
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2024, Jisheng Zhang <jszhang@kernel.org>. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * zram with a budget that the guest fills up. A page that doesn't fit has
+ * to stay readable in its slot, and once nothing fits any more zram has to
+ * say so with zram_failed instead of handing out wrong data.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zram.h"
+
+#define RAM_PAGES	32
+#define PAGE		ZRAM_PAGE_SIZE
+#define ITERATIONS	20000
+
+static uint8_t ref[RAM_PAGES][PAGE];
+static int failures;
+
+/* Random bytes, which don't compress, or zeros */
+static void Write(uint32_t page, int zero)
+{
+	uint32_t i;
+
+	for (i = 0; i < PAGE; i++)
+		ref[page][i] = zero ? 0 : rand();
+	zram_write(page * PAGE, ref[page], PAGE);
+}
+
+static void Check(uint32_t page)
+{
+	uint8_t buf[PAGE];
+
+	zram_read(page * PAGE, buf, PAGE);
+	if (!zram_failed && memcmp(buf, ref[page], PAGE) && failures++ < 10)
+		printf("page %u reads back wrong\n", page);
+}
+
+static void CheckAll(uint32_t pages)
+{
+	uint32_t i;
+
+	for (i = 0; i < pages; i++)
+		Check(i);
+}
+
+static void Load(uint32_t budget_pages)
+{
+	memset(ref, 0, sizeof(ref));
+	zram_budget = budget_pages * PAGE;
+	if (zram_load(RAM_PAGES * PAGE, NULL, 0) < 0) {
+		printf("zram_load failed\n");
+		exit(1);
+	}
+}
+
+/*
+ * With 8 pages of budget: 0-7 go to the budget, 8 is left in a slot
+ * next to clean ones, so 9 can still be loaded. Clearing page 3 makes
+ * room for 8 again.
+ */
+static void Kept(void)
+{
+	uint32_t i;
+
+	Load(8);
+	for (i = 0; i < 9; i++)
+		Write(i, 0);
+	Check(0);
+	Check(1);
+	Check(2);
+	Write(9, 0);
+	if (zram_failed) {
+		printf("page 8 wasn't kept in its slot\n");
+		failures++;
+	}
+	CheckAll(10);
+	Write(3, 1);
+	CheckAll(10);
+	if (zram_failed) {
+		printf("zram failed with room made\n");
+		failures++;
+	}
+}
+
+/* Random pages until the budget is gone, what was written reads back until then */
+static void Fill(uint32_t budget_pages)
+{
+	uint32_t page;
+	int i;
+
+	Load(budget_pages);
+	for (i = 0; i < ITERATIONS && !zram_failed; i++) {
+		page = rand() % RAM_PAGES;
+		switch (rand() % 4) {
+		case 0:
+			Write(page, 0);
+			break;
+		case 1:
+			Write(page, 1);
+			break;
+		default:
+			Check(page);
+			break;
+		}
+	}
+	if (!zram_failed) {
+		printf("%u pages of budget never ran out\n", budget_pages);
+		failures++;
+	}
+}
+
+int main(void)
+{
+	uint32_t budget;
+
+	srand(1);
+	Kept();
+	for (budget = 4; budget <= 16; budget += 4)
+		Fill(budget);
+
+	zram_report(stdout);
+	printf("zram-budget: %d failures\n", failures);
+	return failures != 0;
+}
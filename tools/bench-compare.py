@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Compare two results of the posix port's benchmark mode (-x script -o out.json),
+# phase by phase. Exits with 1 if a phase got slower than --threshold percent
+# in wall time, or if either run failed.
+
+import argparse
+import json
+import sys
+
+METRICS = [
+    ("wall_us", "wall us"),
+    ("insns", "instructions"),
+    ("hit_rate", "cache hit %"),
+    ("psram_xfers", "psram xfers"),
+    ("psram_read_bytes", "psram read B"),
+    ("psram_write_bytes", "psram write B"),
+]
+
+
+def load(path):
+    with open(path) as f:
+        res = json.load(f)
+    for p in res["phases"]:
+        p["hit_rate"] = 100.0 * p["cache_hits"] / p["cache_accesses"] if p["cache_accesses"] else 0.0
+    return res
+
+
+def fmt(v):
+    return "%.2f" % v if isinstance(v, float) else str(v)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument("baseline")
+    ap.add_argument("result")
+    ap.add_argument("--threshold", type=float, default=5.0,
+                    help="wall time regression in percent that fails, default 5")
+    args = ap.parse_args()
+
+    base, new = load(args.baseline), load(args.result)
+    failed = False
+    for res, path in ((base, args.baseline), (new, args.result)):
+        if "error" in res:
+            print("%s: %s" % (path, res["error"]))
+            failed = True
+
+    base_phases = {p["name"]: p for p in base["phases"]}
+    print("%-12s %-14s %16s %16s %9s" % ("phase", "metric", "baseline", "result", "change"))
+    for p in new["phases"]:
+        b = base_phases.get(p["name"])
+        if not b:
+            print("%-12s not in the baseline" % p["name"])
+            continue
+        for key, name in METRICS:
+            if b[key]:
+                change = "%+8.1f%%" % (100.0 * (p[key] - b[key]) / b[key])
+            else:
+                change = "%9s" % "-"
+            print("%-12s %-14s %16s %16s %s" % (p["name"], name, fmt(b[key]), fmt(p[key]), change))
+        if b["wall_us"] and 100.0 * (p["wall_us"] - b["wall_us"]) / b["wall_us"] > args.threshold:
+            print("%-12s slower than the baseline by more than %.1f%%" % (p["name"], args.threshold))
+            failed = True
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Turn the "prof" lines the emulator prints on exit when run with -P into
+# folded stacks for flamegraph.pl or speedscope, symbolized against the
+# guest kernel's System.map or vmlinux:
+#
+#   profile-fold.py -m System.map emu.log | flamegraph.pl > prof.svg
+
+import argparse
+import bisect
+import os
+import subprocess
+import sys
+
+
+def load_nm(lines):
+    syms = []
+    for line in lines:
+        f = line.split()
+        if len(f) < 3 or f[1] not in "tTwW":
+            continue
+        syms.append((int(f[0], 16), f[2]))
+    syms.sort()
+    return syms
+
+
+def load_symbols(args):
+    if args.map:
+        with open(args.map) as f:
+            return load_nm(f)
+    nm = os.environ.get("CROSS_COMPILE", "") + "nm"
+    out = subprocess.run([nm, "-n", args.vmlinux], check=True, capture_output=True, text=True)
+    return load_nm(out.stdout.splitlines())
+
+
+class Symbolizer:
+    def __init__(self, syms):
+        self.addrs = [a for a, _ in syms]
+        self.names = [n for _, n in syms]
+        self.cache = {}
+
+    def __call__(self, addr, offsets):
+        key = (addr, offsets)
+        if key not in self.cache:
+            i = bisect.bisect_right(self.addrs, addr) - 1
+            if i < 0:
+                name = "0x%08x" % addr
+            elif offsets:
+                name = "%s+0x%x" % (self.names[i], addr - self.addrs[i])
+            else:
+                name = self.names[i]
+            self.cache[key] = name
+        return self.cache[key]
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Fold the -P profile of the emulator into flamegraph stacks")
+    src = ap.add_mutually_exclusive_group(required=True)
+    src.add_argument("-m", "--map", help="System.map of the guest kernel")
+    src.add_argument("-k", "--vmlinux", help="guest vmlinux, read with $CROSS_COMPILE nm")
+    ap.add_argument("--miss", action="store_true",
+                    help="add a [miss] or [hit] frame on top: whether the slice took cache misses")
+    ap.add_argument("--offsets", action="store_true", help="keep the offset into each function")
+    ap.add_argument("log", nargs="?", help="emulator output, default stdin")
+    args = ap.parse_args()
+
+    sym = Symbolizer(load_symbols(args))
+    folded = {}
+    log = open(args.log, errors="replace") if args.log else sys.stdin
+    for line in log:
+        f = line.split()
+        if len(f) < 4 or f[0] != "prof":
+            continue
+        count, miss = int(f[1]), int(f[2])
+        pcs = [int(a, 16) for a in f[3:]]
+        # return addresses point after the call, name the call itself
+        frames = [sym(pcs[0], args.offsets)] + [sym(a - 4, args.offsets) for a in pcs[1:]]
+        frames.reverse()
+        if args.miss:
+            frames.append("[miss]" if miss else "[hit]")
+        key = ";".join(frames)
+        folded[key] = folded.get(key, 0) + count
+
+    for key, count in sorted(folded.items()):
+        print(key, count)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Convert the event ring the posix port writes with -t (on exit or SIGUSR1)
+# to Chrome trace JSON, which ui.perfetto.dev and chrome://tracing open.
+# Traps and WFI become slices per hart, MMIO accesses instants per device,
+# cache misses and writebacks a counter per --bucket microseconds and the
+# UART lines instants. See main/trace.h for the format.
+
+import argparse
+import json
+import struct
+import sys
+
+HDR = struct.Struct("<8sIIQ")
+EV = struct.Struct("<QIHBB")
+NAME_LEN = 16
+
+(TRAP, MRET, WFI_ENTER, WFI_EXIT, MMIO_READ, MMIO_WRITE,
+ CACHE_MISS, WRITEBACK, UART_TX, UART_RX) = range(10)
+
+INTERRUPTS = {3: "soft irq", 7: "timer irq", 11: "external irq"}
+EXCEPTIONS = {
+    0: "insn misaligned", 1: "insn access fault", 2: "illegal insn", 3: "breakpoint",
+    4: "load misaligned", 5: "load access fault", 6: "store misaligned",
+    7: "store access fault", 8: "ecall from U", 11: "ecall from M",
+}
+
+PID = 1
+# thread ids of the tracks, harts get TID_HART + hart
+TID_HART, TID_IDLE, TID_MMIO, TID_UART = 0, 100, 200, 300
+
+
+def cause_name(mcause):
+    if mcause & 0x80000000:
+        return INTERRUPTS.get(mcause & 0x7fffffff, "irq %d" % (mcause & 0x7fffffff))
+    return EXCEPTIONS.get(mcause, "exception %d" % mcause)
+
+
+def read_trace(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, nr_devs, nr_events, lost = HDR.unpack_from(data, 0)
+    if magic != b"uctrace1":
+        sys.exit("%s: not a trace" % path)
+    off = HDR.size
+    devs = []
+    for _ in range(nr_devs):
+        devs.append(data[off:off + NAME_LEN].split(b"\0")[0].decode())
+        off += NAME_LEN
+    events = [EV.unpack_from(data, off + i * EV.size) for i in range(nr_events)]
+    return devs, events, lost
+
+
+def convert(devs, events, lost, args):
+    out = []
+    meta = lambda tid, name: out.append({"ph": "M", "name": "thread_name", "pid": PID, "tid": tid,
+                                         "args": {"name": name}})
+    out.append({"ph": "M", "name": "process_name", "pid": PID, "args": {"name": "uc-rv32ima"}})
+    meta(TID_MMIO, "mmio")
+    meta(TID_UART, "uart")
+
+    t0 = events[0][0] if events else 0
+    harts = set()
+    depth = {}
+    line = {TID_UART: [], TID_UART + 1: []}
+    miss = wb = 0
+    bucket = None
+
+    for us, arg, dev, typ, hart in events:
+        ts = us - t0
+        if hart not in harts:
+            harts.add(hart)
+            meta(TID_HART + hart, "hart %d traps" % hart)
+            meta(TID_IDLE + hart, "hart %d wfi" % hart)
+
+        if args.bucket and typ in (CACHE_MISS, WRITEBACK):
+            b = ts // args.bucket * args.bucket
+            if b != bucket:
+                if bucket is not None:
+                    out.append({"ph": "C", "name": "cache", "pid": PID, "ts": bucket,
+                                "args": {"misses": miss, "writebacks": wb}})
+                bucket, miss, wb = b, 0, 0
+            if typ == CACHE_MISS:
+                miss += 1
+            else:
+                wb += 1
+
+        if typ == TRAP:
+            depth[hart] = depth.get(hart, 0) + 1
+            out.append({"ph": "B", "name": cause_name(arg), "pid": PID, "tid": TID_HART + hart,
+                        "ts": ts, "args": {"mcause": "0x%x" % arg}})
+        elif typ == MRET:
+            # the ring may start inside a handler
+            if depth.get(hart):
+                depth[hart] -= 1
+                out.append({"ph": "E", "pid": PID, "tid": TID_HART + hart, "ts": ts})
+        elif typ == WFI_ENTER:
+            out.append({"ph": "B", "name": "wfi", "pid": PID, "tid": TID_IDLE + hart, "ts": ts})
+        elif typ == WFI_EXIT:
+            out.append({"ph": "E", "pid": PID, "tid": TID_IDLE + hart, "ts": ts})
+        elif typ in (MMIO_READ, MMIO_WRITE) and args.mmio:
+            name = devs[dev] if dev < len(devs) else "dev %d" % dev
+            out.append({"ph": "i", "s": "t", "name": "%s %s" % (name, "r" if typ == MMIO_READ else "w"),
+                        "pid": PID, "tid": TID_MMIO, "ts": ts, "args": {"offset": "0x%x" % arg}})
+        elif typ in (CACHE_MISS, WRITEBACK) and args.cache_events:
+            out.append({"ph": "i", "s": "t", "name": "miss" if typ == CACHE_MISS else "writeback",
+                        "pid": PID, "tid": TID_MMIO + 1, "ts": ts, "args": {"offset": "0x%x" % arg}})
+        elif typ in (UART_TX, UART_RX):
+            # one instant per line, at its first byte
+            tid = TID_UART + (typ == UART_RX)
+            buf = line[tid]
+            if not buf:
+                buf.append(ts)
+            if arg == ord("\n") or len(buf) > 200:
+                text = bytes(buf[1:]).decode("utf-8", "replace").rstrip("\r")
+                out.append({"ph": "i", "s": "t", "name": text, "pid": PID, "tid": tid, "ts": buf[0]})
+                buf.clear()
+            else:
+                buf.append(arg & 0xff)
+
+    if bucket is not None:
+        out.append({"ph": "C", "name": "cache", "pid": PID, "ts": bucket,
+                    "args": {"misses": miss, "writebacks": wb}})
+    if args.cache_events:
+        meta(TID_MMIO + 1, "cache")
+    meta(TID_UART + 1, "uart rx")
+    return {"traceEvents": out, "otherData": {"lost_events": lost}}
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Convert a -t trace to Chrome/Perfetto JSON")
+    ap.add_argument("trace", help="trace written by the emulator")
+    ap.add_argument("-o", "--output", help="JSON file, default stdout")
+    ap.add_argument("--bucket", type=int, default=1000,
+                    help="microseconds per cache counter sample, 0 for none")
+    ap.add_argument("--cache-events", action="store_true", help="also one instant per miss and writeback")
+    ap.add_argument("--no-mmio", dest="mmio", action="store_false", help="leave out MMIO accesses")
+    args = ap.parse_args()
+
+    devs, events, lost = read_trace(args.trace)
+    res = convert(devs, events, lost, args)
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(res, f)
+    else:
+        json.dump(res, sys.stdout)
+    print("%d events, %d lost" % (len(events), lost), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()